@@ -0,0 +1,124 @@
+/*
+ * Example and smoke test of the libudpcan API: bridges two CAN interfaces
+ * over UDP on localhost, sends frames into the first bridge with
+ * udpcan_send() from an application event loop built on poll(), and checks
+ * with callbacks that the second bridge forwards all of them to CAN.
+ *
+ * Usage: udpcan-example CAN_IFNAME_A CAN_IFNAME_B [N_FRAMES]
+ * Exits with 0 if all frames arrived within a second, 1 otherwise.
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "udpcan.h"
+
+/* Frames seen by the callbacks of the receiving bridge. */
+struct rx_count {
+	int frames;
+	int batches;
+	/* Frames seen by the batch callback. */
+	int batch_frames;
+	/* Set if a frame arrived out of order or corrupted. */
+	int bad;
+};
+
+static void on_frame(struct udpcan_bridge *bridge, enum udpcan_dir dir,
+		const struct can_frame *frame, void *arg)
+{
+	struct rx_count *count = arg;
+	(void)bridge;
+	if (dir != UDPCAN_UDP_TO_CAN)
+		return;
+	if (frame->can_id != (canid_t)(count->frames & CAN_SFF_MASK) ||
+			frame->len != 1 || frame->data[0] != (uint8_t)count->frames)
+		count->bad = 1;
+	count->frames++;
+}
+
+static void on_batch(struct udpcan_bridge *bridge, enum udpcan_dir dir,
+		const struct can_frame *frames, int n_frames, void *arg)
+{
+	struct rx_count *count = arg;
+	(void)bridge;
+	(void)frames;
+	if (dir != UDPCAN_UDP_TO_CAN)
+		return;
+	count->batches++;
+	count->batch_frames += n_frames;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3 || argc > 4)
+		errx(EXIT_FAILURE, "Usage: %s CAN_IFNAME_A CAN_IFNAME_B "
+				"[N_FRAMES]", argv[0]);
+	int n_frames = argc == 4 ? atoi(argv[3]) : 1000;
+	if (n_frames <= 0)
+		errx(EXIT_FAILURE, "Invalid number of frames: '%s'", argv[3]);
+	struct udpcan *udpcan = udpcan_create(2, 0);
+	if (!udpcan)
+		return EXIT_FAILURE;
+	char spec_a[64], spec_b[64];
+	snprintf(spec_a, sizeof(spec_a), "%s:8880:127.0.0.1:8881,quiet",
+			argv[1]);
+	snprintf(spec_b, sizeof(spec_b), "%s:8881:127.0.0.1:8880,quiet",
+			argv[2]);
+	struct udpcan_bridge *tx = udpcan_add_bridge(udpcan, spec_a);
+	/* A rejected spec leaves the other bridges alone. */
+	if (udpcan_add_bridge(udpcan, "invalid"))
+		errx(EXIT_FAILURE, "Invalid spec accepted");
+	struct udpcan_bridge *rx = udpcan_add_bridge(udpcan, spec_b);
+	if (!tx || !rx || udpcan_start(udpcan) == -1) {
+		udpcan_destroy(udpcan);
+		return EXIT_FAILURE;
+	}
+	struct rx_count count = {0};
+	udpcan_set_frame_cb(rx, on_frame, &count);
+	udpcan_set_batch_cb(rx, on_batch, &count);
+
+	/* The application's own event loop, with udpcan as one of its fds. */
+	struct pollfd pfd = {
+		.fd = udpcan_fd(udpcan),
+		.events = POLLIN,
+	};
+	int sent = 0;
+	double deadline_ms = now_ms() + 1000;
+	while (count.frames < n_frames && now_ms() < deadline_ms) {
+		/* Don't overrun the socket buffers of the receiving bridge. */
+		while (sent < n_frames && sent - count.frames < 64) {
+			struct can_frame frame = {
+				.can_id = sent & CAN_SFF_MASK,
+				.len = 1,
+				.data = {(uint8_t)sent},
+			};
+			if (udpcan_send(tx, &frame) == -1)
+				err(EXIT_FAILURE, "udpcan_send");
+			sent++;
+		}
+		if (poll(&pfd, 1, 10) == -1 && errno != EINTR)
+			err(EXIT_FAILURE, "poll");
+		if (pfd.revents & POLLIN)
+			udpcan_poll(udpcan, 0, NULL);
+	}
+	udpcan_print_stats(udpcan);
+	udpcan_destroy(udpcan);
+
+	printf("udpcan-example: %d of %d frames forwarded in %d batches%s\n",
+			count.frames, n_frames, count.batches,
+			count.bad ? ", some out of order or corrupted" : "");
+	return count.frames == n_frames && count.batch_frames == n_frames &&
+			!count.bad ? EXIT_SUCCESS : EXIT_FAILURE;
+}
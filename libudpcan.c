@@ -0,0 +1,7061 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <linux/can.h>
+#include <linux/can/error.h>
+#include <linux/can/j1939.h>
+#include <linux/can/raw.h>
+#include <linux/bpf.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/net_tstamp.h>
+#include <limits.h>
+#include <netdb.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(UDPCAN_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+#include "udpcan.h"
+
+/*
+ * Errors are fatal for the udpcan command. The library catches those of the
+ * calls that set up bridges instead, see udpcan_add_bridge(): fail() and
+ * failx() print a message like err() and errx(), then make the call return an
+ * error if one is catching.
+ */
+static jmp_buf *fail_catch;
+
+static _Noreturn void fail_exit(void)
+{
+	if (fail_catch)
+		longjmp(*fail_catch, 1);
+	exit(EXIT_FAILURE);
+}
+
+#define fail(...) do { warn(__VA_ARGS__); fail_exit(); } while (0)
+#define failx(...) do { warnx(__VA_ARGS__); fail_exit(); } while (0)
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+	if (!p) failx("Out of memory");
+	return p;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+	if (!p) failx("Out of memory");
+	return p;
+}
+
+static char *xstrdup(const char *s)
+{
+	char *p = strdup(s);
+	if (!p) failx("Out of memory");
+	return p;
+}
+
+/*
+ * Memory touched by the event loop (connection state, frame and batch
+ * buffers, mmsghdr and iovec arrays, packet pools) comes from an arena that
+ * is filled during setup and freed by udpcan_destroy() only, so that
+ * forwarding performs no malloc() or free(). Memory is mapped in
+ * ARENA_CHUNK_SIZE chunks, populated up front so that the event loop takes no
+ * page faults either, and on huge pages if requested. Allocations are zeroed
+ * and cache line aligned; allocations of a chunk or more get their own
+ * mapping, rounded up to a multiple of the chunk size but only page aligned
+ * (huge page aligned on huge pages).
+ */
+#define ARENA_CHUNK_SIZE (2 << 20)
+#define ARENA_ALIGN 64
+
+struct arena {
+	uint8_t *next;
+	size_t left;
+	/* Use huge pages while they are available. */
+	bool huge;
+	/* Statistics. */
+	size_t mapped, used;
+	size_t huge_mapped;
+};
+
+/* Memory mapping released by udpcan_destroy(). */
+struct mapping {
+	void *addr;
+	size_t size;
+};
+
+/*
+ * Resources of a udpcan instance, released by udpcan_destroy(). They are
+ * registered with the instance being set up, which setup functions find in
+ * resources.
+ */
+struct resources {
+	struct arena arena;
+	/* Arena chunks and other mappings, such as AF_XDP rings. */
+	struct mapping *maps;
+	int n_maps;
+	/* Sockets, epoll fds, timerfds and BPF objects, in opening order. */
+	int *fds;
+	int n_fds;
+};
+
+static struct resources *resources;
+
+/* Makes udpcan_destroy() unmap a mapping of the instance being set up. */
+static void own_mapping(void *addr, size_t size)
+{
+	resources->maps = xrealloc(resources->maps,
+			sizeof(*resources->maps) * (resources->n_maps + 1));
+	resources->maps[resources->n_maps++] = (struct mapping) {
+		.addr = addr,
+		.size = size,
+	};
+}
+
+/* Makes udpcan_destroy() close an fd of the instance being set up. */
+static void own_fd(int fd)
+{
+	resources->fds = xrealloc(resources->fds,
+			sizeof(*resources->fds) * (resources->n_fds + 1));
+	resources->fds[resources->n_fds++] = fd;
+}
+
+/* Closes the fds of an instance opened after the first n_fds ones. */
+static void close_fds(struct resources *res, int n_fds)
+{
+	while (res->n_fds > n_fds)
+		close(res->fds[--res->n_fds]);
+}
+
+static void *arena_map(size_t size)
+{
+	struct arena *arena = &resources->arena;
+	void *p = MAP_FAILED;
+	if (arena->huge) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+				MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB,
+				-1, 0);
+		if (p == MAP_FAILED) {
+			warn("Failed to map huge pages, using normal pages");
+			arena->huge = false;
+		} else {
+			arena->huge_mapped += size;
+		}
+	}
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+				-1, 0);
+		if (p == MAP_FAILED)
+			fail("mmap");
+	}
+	own_mapping(p, size);
+	arena->mapped += size;
+	return p;
+}
+
+static void *arena_alloc(size_t size)
+{
+	struct arena *arena = &resources->arena;
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	arena->used += size;
+	if (size >= ARENA_CHUNK_SIZE) {
+		return arena_map((size + ARENA_CHUNK_SIZE - 1) &
+				~(size_t)(ARENA_CHUNK_SIZE - 1));
+	}
+	if (size > arena->left) {
+		arena->next = arena_map(ARENA_CHUNK_SIZE);
+		arena->left = ARENA_CHUNK_SIZE;
+	}
+	void *p = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return p;
+}
+
+#ifdef UDPCAN_DEBUG_ALLOC
+/*
+ * Debug build: the allocator functions are wrapped to count heap allocations
+ * made once the event loop runs. The loop asserts that there are none.
+ */
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+static bool heap_locked;
+static uint64_t heap_locked_calls;
+
+void *malloc(size_t size)
+{
+	heap_locked_calls += heap_locked;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	heap_locked_calls += heap_locked;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	heap_locked_calls += heap_locked;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	heap_locked_calls += heap_locked && ptr;
+	__libc_free(ptr);
+}
+
+#define HEAP_LOCK() (heap_locked = true)
+#define HEAP_UNLOCK() (heap_locked = false)
+#define HEAP_CHECK() assert(heap_locked_calls == 0)
+#else
+#define HEAP_LOCK() do { } while (0)
+#define HEAP_UNLOCK() do { } while (0)
+#define HEAP_CHECK() do { } while (0)
+#endif
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/* Declares a control message buffer suitably aligned for struct cmsghdr. */
+#define CMSG_BUFFER(name, size) \
+	char name[size] __attribute__((aligned(__alignof__(struct cmsghdr))))
+
+/*
+ * Static user-space tracepoints (USDT) in the SystemTap SDT note format
+ * understood by perf, bpftrace and SystemTap. A probe is a single nop until a
+ * tracer attaches to it. Arguments are passed as signed 64-bit integers.
+ * Compiled out on architectures other than x86-64 and AArch64 or with
+ * -DUDPCAN_NO_PROBES.
+ */
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(UDPCAN_NO_PROBES)
+#define PROBE_ASM(name, args) \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991: .asciz \"stapsdt\"\n" \
+	"992: .balign 4\n" \
+	"993: .8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte 0\n" \
+	".asciz \"udpcan\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+#define PROBE_ARG(a) "nor" ((int64_t)(a))
+#define PROBE3(name, a1, a2, a3) \
+	__asm__ __volatile__(PROBE_ASM(name, "-8@%0 -8@%1 -8@%2") :: \
+			PROBE_ARG(a1), PROBE_ARG(a2), PROBE_ARG(a3))
+#define PROBE4(name, a1, a2, a3, a4) \
+	__asm__ __volatile__(PROBE_ASM(name, "-8@%0 -8@%1 -8@%2 -8@%3") :: \
+			PROBE_ARG(a1), PROBE_ARG(a2), PROBE_ARG(a3), \
+			PROBE_ARG(a4))
+#else
+#define PROBE3(name, a1, a2, a3) \
+	do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define PROBE4(name, a1, a2, a3, a4) \
+	do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+#endif
+
+/* Reasons passed to the drop tracepoint. */
+enum drop_reason {
+	/* Source not in the allowlist. */
+	DROP_SOURCE,
+	/* Malformed datagram. */
+	DROP_MALFORMED,
+	/* Authenticated datagram rejected. */
+	DROP_AUTH,
+	/* CAN controller in the bus-off state. */
+	DROP_BUS_OFF,
+	/* All destinations dead. */
+	DROP_SUPPRESSED,
+	/* Lost or overflowed in the impairment stage. */
+	DROP_IMPAIR,
+};
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* Returns the current monotonic time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_ns(&ts);
+}
+
+/* Returns the current wall-clock time in nanoseconds. */
+static uint64_t now_realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return timespec_ns(&ts);
+}
+
+#define HISTOGRAM_BUCKETS 64
+
+/*
+ * Histogram of durations in nanoseconds. Bucket i counts values in range
+ * [2^(i-1), 2^i), bucket 0 counts zeros.
+ */
+struct histogram {
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+static void histogram_add(struct histogram *hist, uint64_t value)
+{
+	int i = value == 0 ? 0 : 64 - __builtin_clzll(value);
+	if (i >= HISTOGRAM_BUCKETS)
+		i = HISTOGRAM_BUCKETS - 1;
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/*
+ * Returns the upper bound of the bucket containing the given percentile of
+ * values stored in a histogram.
+ */
+static uint64_t histogram_percentile(const struct histogram *hist,
+		unsigned percent)
+{
+	uint64_t rank = (hist->count * percent + 99) / 100;
+	uint64_t seen = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank && seen > 0) {
+			uint64_t bound = i == 0 ? 0 : (1ULL << i) - 1;
+			return bound < hist->max ? bound : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+/*
+ * Prints a histogram summary to stdout in microseconds. The prefix and name
+ * identify the histogram.
+ */
+static void print_histogram(const char *prefix, const char *name,
+		const struct histogram *hist)
+{
+	if (hist->count == 0) {
+		printf("%s: %s: no samples\n", prefix, name);
+		return;
+	}
+	printf("%s: %s: count %llu, avg %.1f us, p50 %.1f us, p90 %.1f us, "
+			"p99 %.1f us, max %.1f us\n", prefix, name,
+			(unsigned long long)hist->count,
+			(double)hist->sum / hist->count / 1000,
+			histogram_percentile(hist, 50) / 1000.0,
+			histogram_percentile(hist, 90) / 1000.0,
+			histogram_percentile(hist, 99) / 1000.0,
+			hist->max / 1000.0);
+}
+
+/*
+ * Per-stage profiler, compiled in with -DUDPCAN_PROFILE (make udpcan-prof).
+ * Handlers call PROF_MARK() after each stage, which attributes the time since
+ * the previous mark (or since PROF_BEGIN() before the handler was called) to
+ * the stage. Time is read with rdtsc where available and converted to
+ * nanoseconds with a factor calibrated on startup. udpcan is single-threaded,
+ * so a single set of histograms serves as the per-thread one.
+ */
+#ifdef UDPCAN_PROFILE
+enum prof_stage {
+	PROF_RECV,
+	PROF_FILTER,
+	PROF_DECODE,
+	PROF_ENCODE,
+	PROF_LOG,
+	PROF_SEND,
+	PROF_TIMERS,
+	/* Time in handlers not attributed to any of the above. */
+	PROF_OTHER,
+	PROF_STAGES,
+};
+
+static const char *const prof_stage_names[PROF_STAGES] = {
+	[PROF_RECV] = "recv",
+	[PROF_FILTER] = "filter",
+	[PROF_DECODE] = "decode",
+	[PROF_ENCODE] = "encode",
+	[PROF_LOG] = "log",
+	[PROF_SEND] = "send",
+	[PROF_TIMERS] = "timers",
+	[PROF_OTHER] = "other",
+};
+
+static struct {
+	struct histogram stages[PROF_STAGES];
+	/* Ticks at the previous mark. */
+	uint64_t last;
+	/* Nanoseconds per tick, scaled by 2^32. */
+	uint64_t mult;
+} profiler;
+
+static uint64_t prof_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+/* Calibrates the tick rate against CLOCK_MONOTONIC. */
+static void prof_init(void)
+{
+	struct timespec delay = {.tv_nsec = 20000000};
+	uint64_t start_ns = now_ns();
+	uint64_t start = prof_ticks();
+	nanosleep(&delay, NULL);
+	uint64_t ticks = prof_ticks() - start;
+	uint64_t ns = now_ns() - start_ns;
+	profiler.mult = ticks > 0 ? (ns << 32) / ticks : 1ULL << 32;
+}
+
+static void prof_mark(enum prof_stage stage)
+{
+	uint64_t now = prof_ticks();
+	uint64_t ns = ((unsigned __int128)(now - profiler.last) *
+			profiler.mult) >> 32;
+	histogram_add(&profiler.stages[stage], ns);
+	profiler.last = now;
+}
+
+static void print_profile(void)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < PROF_STAGES; i++)
+		total += profiler.stages[i].sum;
+	for (int i = 0; i < PROF_STAGES; i++) {
+		const struct histogram *hist = &profiler.stages[i];
+		if (hist->count == 0)
+			continue;
+		printf("udpcan: profile %s: count %llu, total %.3f ms "
+				"(%.1f%%), avg %llu ns, p50 %llu ns, "
+				"p99 %llu ns, max %llu ns\n",
+				prof_stage_names[i],
+				(unsigned long long)hist->count,
+				hist->sum / 1e6, 100.0 * hist->sum / total,
+				(unsigned long long)(hist->sum / hist->count),
+				(unsigned long long)histogram_percentile(hist, 50),
+				(unsigned long long)histogram_percentile(hist, 99),
+				(unsigned long long)hist->max);
+	}
+}
+
+#define PROF_BEGIN() (profiler.last = prof_ticks())
+#define PROF_MARK(stage) prof_mark(stage)
+#else
+#define PROF_BEGIN() do { } while (0)
+#define PROF_MARK(stage) do { } while (0)
+#endif
+
+/*
+ * Returns a human-readable string representation of a CAN frame in format
+ * <can_id>#<data>. Uses a statically allocated buffer.
+ */
+static const char *str_can_frame(const struct can_frame *frame)
+{
+	static char buf[32];
+	char *s = buf, *end = buf + sizeof(buf);
+	s += snprintf(s, end - s, "%.3X#", (unsigned)frame->can_id);
+	for (int i = 0; i < (int)frame->can_dlc; i++)
+		s += snprintf(s, end - s, "%.2X", (unsigned)frame->data[i]);
+	return buf;
+}
+
+/*
+ * Initializes a CAN frame from a string in format <can_id>#<data>, as printed
+ * by str_can_frame(). A CAN id given with 8 hex digits is an extended id.
+ * Returns 0 on success, -1 on invalid input.
+ */
+static int parse_can_frame(const char *s, struct can_frame *frame)
+{
+	memset(frame, 0, sizeof(*frame));
+	const char *sep = strchr(s, '#');
+	if (!sep || (sep - s != 3 && sep - s != 8))
+		return -1;
+	char *end;
+	unsigned long id = strtoul(s, &end, 16);
+	if (end != sep)
+		return -1;
+	if (sep - s == 8) {
+		if (id > CAN_EFF_MASK)
+			return -1;
+		frame->can_id = id | CAN_EFF_FLAG;
+	} else {
+		if (id > CAN_SFF_MASK)
+			return -1;
+		frame->can_id = id;
+	}
+	s = sep + 1;
+	size_t len = strlen(s);
+	if (len % 2 != 0 || len / 2 > sizeof(frame->data))
+		return -1;
+	for (size_t i = 0; i < len / 2; i++) {
+		char byte[3] = {s[i * 2], s[i * 2 + 1], '\0'};
+		frame->data[i] = strtoul(byte, &end, 16);
+		if (*end != '\0' || byte[0] == '+' || byte[0] == '-')
+			return -1;
+	}
+	frame->can_dlc = len / 2;
+	return 0;
+}
+
+#define PACKED_CAN_FRAME_MAX_DATA_SIZE 8
+#define PACKED_CAN_FRAME_HDR_SIZE \
+	(sizeof(struct packed_can_frame) - PACKED_CAN_FRAME_MAX_DATA_SIZE)
+/*
+ * Max number of CAN frames read from a CAN socket at once, and in an
+ * authenticated datagram.
+ */
+#define MAX_BATCH 64
+
+
+/*
+ * CAN frame representation suitable for transmission via network. All values
+ * are in the network byte order.
+ */
+struct packed_can_frame {
+	uint32_t can_id;
+	uint8_t data[PACKED_CAN_FRAME_MAX_DATA_SIZE];
+};
+
+static void pack_can_frame(const struct can_frame *frame,
+		struct packed_can_frame *packed_frame,
+		size_t *packed_frame_size)
+{
+	packed_frame->can_id = htonl(frame->can_id);
+	assert(frame->can_dlc <= PACKED_CAN_FRAME_MAX_DATA_SIZE);
+	memcpy(packed_frame->data, frame->data, frame->can_dlc);
+	*packed_frame_size = frame->can_dlc + PACKED_CAN_FRAME_HDR_SIZE;
+}
+
+_Static_assert(offsetof(struct can_frame, data) ==
+		sizeof(canid_t) + offsetof(struct packed_can_frame, data),
+		"packed CAN frame can't overlay struct can_frame");
+
+/*
+ * Packs a CAN frame in place. The packed frame overlays the frame from its
+ * can_dlc field on, so that the data stays where it is and only the CAN id is
+ * written. Returns the packed frame; the frame itself is clobbered.
+ */
+static struct packed_can_frame *pack_can_frame_in_place(
+		struct can_frame *frame, size_t *packed_frame_size)
+{
+	struct packed_can_frame *packed_frame =
+			(void *)((uint8_t *)frame + sizeof(canid_t));
+	uint32_t can_id = frame->can_id;
+	assert(frame->can_dlc <= PACKED_CAN_FRAME_MAX_DATA_SIZE);
+	*packed_frame_size = frame->can_dlc + PACKED_CAN_FRAME_HDR_SIZE;
+	packed_frame->can_id = htonl(can_id);
+	return packed_frame;
+}
+
+static void unpack_can_frame(const struct packed_can_frame *packed_frame,
+		size_t packed_frame_size, struct can_frame *frame)
+{
+	assert(packed_frame_size <= sizeof(*packed_frame));
+	size_t data_size = packed_frame_size - PACKED_CAN_FRAME_HDR_SIZE;
+	assert(data_size <= PACKED_CAN_FRAME_MAX_DATA_SIZE);
+	frame->can_id = ntohl(packed_frame->can_id);
+	frame->can_dlc = data_size;
+	memcpy(frame->data, packed_frame->data, data_size);
+}
+
+/*
+ * J1939 message header suitable for transmission via network. Followed by up
+ * to J1939_MAX_DATA_SIZE bytes of data. All values are in the network byte
+ * order.
+ */
+struct packed_j1939_hdr {
+	uint32_t pgn;
+	uint8_t priority;
+	uint8_t src_addr;
+	uint8_t dst_addr;
+	uint8_t reserved;
+};
+
+/* Max size of a J1939 message reassembled by the transport protocol. */
+#define J1939_MAX_DATA_SIZE 1785
+
+/*
+ * J1939 message representation suitable for transmission via network.
+ */
+struct packed_j1939_msg {
+	struct packed_j1939_hdr hdr;
+	uint8_t data[J1939_MAX_DATA_SIZE];
+};
+
+/*
+ * Returns a human-readable string representation of a J1939 message in format
+ * <pgn>:<src_addr>-><dst_addr>:<priority>#<data>. Long messages are elided.
+ * Uses a statically allocated buffer.
+ */
+static const char *str_j1939_msg(const struct packed_j1939_msg *msg,
+		size_t data_size)
+{
+	static char buf[64];
+	char *s = buf, *end = buf + sizeof(buf);
+	s += snprintf(s, end - s, "%.5X:%.2X->%.2X:%u#",
+			(unsigned)ntohl(msg->hdr.pgn),
+			(unsigned)msg->hdr.src_addr,
+			(unsigned)msg->hdr.dst_addr,
+			(unsigned)msg->hdr.priority);
+	for (size_t i = 0; i < data_size && end - s > 3; i++) {
+		if (i == 8 && data_size > 9) {
+			snprintf(s, end - s, "..[%zu]", data_size);
+			break;
+		}
+		s += snprintf(s, end - s, "%.2X", (unsigned)msg->data[i]);
+	}
+	return buf;
+}
+
+/* IPv6 address prefix. IPv4 prefixes are stored as IPv4-mapped addresses. */
+struct ip_prefix {
+	struct in6_addr addr;
+	/* Prefix length, 0 to 128. */
+	int len;
+};
+
+/* How CAN frames are spread over multiple destinations. */
+enum dest_policy {
+	/* Send to the first destination that is alive. */
+	DEST_POLICY_FAILOVER,
+	/* Partition frames by a hash of CAN id over live destinations. */
+	DEST_POLICY_HASH,
+};
+
+/* Max period of a cyclic frame, in milliseconds. */
+#define CYCLIC_MAX_PERIOD_MS (24 * 3600 * 1000)
+
+/* CAN frame that udpcan emits periodically. */
+struct cyclic_spec {
+	/* Emission period in milliseconds. */
+	uint32_t period_ms;
+	/* Send to OUT_HOST rather than to the CAN interface. */
+	bool to_udp;
+	struct can_frame frame;
+};
+
+/* Range of CAN ids, flags excluded. */
+struct can_id_range {
+	uint32_t first, last;
+};
+
+/* Max number of CAN id classes with their own marking of UDP packets. */
+#define QOS_MAX_CLASSES 8
+
+/* Marking of UDP packets carrying CAN frames of an id range. */
+struct qos_class {
+	struct can_id_range ids;
+	/* DSCP in the IPv4 TOS or IPv6 traffic class field. */
+	uint8_t dscp;
+	/* SO_PRIORITY of the packets, -1 to keep that of the socket. */
+	int priority;
+};
+
+/* Max number of CAN id classes sent to CAN with their own priority. */
+#define CAN_PRIO_MAX_CLASSES 8
+
+/* Socket priority of UDP->CAN frames of an id range. */
+struct can_prio_class {
+	struct can_id_range ids;
+	int priority;
+};
+
+/* Max delay of the impairment stage, in milliseconds. */
+#define IMPAIR_MAX_DELAY_MS 60000
+
+/* Datagrams affected by the impairment stage. */
+enum impair_dir {
+	IMPAIR_BOTH,
+	/* Datagrams sent to OUT_HOST. */
+	IMPAIR_TX,
+	/* Datagrams received on IN_PORT. */
+	IMPAIR_RX,
+};
+
+/* Simulated network impairments. All zero if disabled. */
+struct impair_config {
+	/* Probabilities of loss, duplication and reordering, scaled to 2^32. */
+	uint64_t loss, dup, reorder;
+	/* Mean delay and jitter. */
+	uint32_t delay_ms, jitter_ms;
+	/* Jitter is normally distributed rather than uniformly. */
+	bool normal;
+	/* Rate cap in kbit/s. */
+	uint32_t rate_kbit;
+	uint64_t seed;
+	enum impair_dir dir;
+};
+
+/* How the XDP program of the xdp option is attached. */
+enum xdp_mode {
+	/* Native if the driver supports it, generic otherwise. */
+	XDP_MODE_AUTO,
+	XDP_MODE_NATIVE,
+	XDP_MODE_GENERIC,
+};
+
+/* Priority class of the events of a connection, see udpcan_poll(). */
+enum prio_class {
+	PRIO_HIGH,
+	PRIO_NORMAL,
+	PRIO_LOW,
+	PRIO_CLASSES,
+};
+
+enum can_proto {
+	/* Raw CAN frames (CAN_RAW). */
+	CAN_PROTO_RAW,
+	/* J1939 messages reassembled by the kernel (CAN_J1939). */
+	CAN_PROTO_J1939,
+};
+
+struct config {
+	/* CAN_IFNAME:IN_PORT:OUT_HOST:OUT_PORT, for messages. */
+	char *name;
+	/* Name of the CAN interface to read/write. */
+	char *can_ifname;
+	/* UDP port to listen for incoming CAN frames. */
+	char *in_port;
+	/*
+	 * UDP host and port to forward CAN frames to. Each may be a list
+	 * separated by '+'.
+	 */
+	char *out_host, *out_port;
+	enum dest_policy dest_policy;
+	/*
+	 * Set if OUT_HOST is '*': CAN frames are sent back to peers that
+	 * sent packets to IN_PORT.
+	 */
+	bool learn_peers;
+	/* Max number of learned peers. */
+	uint32_t max_peers;
+	/* Time after which a silent learned peer is forgotten, in seconds. */
+	uint32_t peer_ttl_s;
+	/* Protocol used to talk to the CAN interface. */
+	enum can_proto can_proto;
+	/*
+	 * J1939 source address used for messages sent to the CAN interface.
+	 * J1939_NO_ADDR if sending is disabled.
+	 */
+	uint8_t j1939_addr;
+	/* Forward CAN error frames to OUT_HOST. */
+	bool forward_err_frames;
+	/* Don't log forwarded frames. */
+	bool quiet;
+	/* Measure UDP->CAN latency with socket TX timestamps. */
+	bool tx_stamps;
+	/*
+	 * If set, UDP->CAN frames are scheduled with SO_TXTIME to leave the
+	 * CAN interface txtime_offset_us after their arrival to IN_PORT.
+	 */
+	bool txtime;
+	uint32_t txtime_offset_us;
+	/* Frames emitted periodically. */
+	struct cyclic_spec *cyclic;
+	int n_cyclic;
+	/* Interval between heartbeats sent to OUT_HOST, 0 if disabled. */
+	uint32_t heartbeat_ms;
+	/* Marking of UDP packets by CAN id, the first matching class wins. */
+	struct qos_class *qos;
+	int n_qos;
+	/*
+	 * Priority of UDP->CAN frames by CAN id, the first matching class
+	 * wins.
+	 */
+	struct can_prio_class *can_prio;
+	int n_can_prio;
+	/*
+	 * Source prefixes allowed to send to IN_PORT. If empty, packets are
+	 * accepted from any source.
+	 */
+	struct ip_prefix *allow;
+	int n_allow;
+	/* Drop packets from other sources in the kernel with a socket filter. */
+	bool allow_kernel;
+	/*
+	 * File with the pre-shared key of the authenticated tunnel, NULL if
+	 * CAN frames are sent in plain datagrams.
+	 */
+	char *auth_key_file;
+	/*
+	 * Max difference between the sequence number of an authenticated
+	 * datagram and the wall clock, 0 if unchecked.
+	 */
+	uint32_t auth_max_skew_ms;
+	/* Max number of CAN frames per authenticated datagram, 0 if unset. */
+	uint32_t batch;
+	/*
+	 * Max latency adaptive batching may add to CAN->UDP frames, 0 if
+	 * batches are not adapted, see struct batch_ctl.
+	 */
+	uint32_t batch_latency_us;
+	struct impair_config impair;
+	/*
+	 * Network interface and queue whose UDP packets to and from IN_PORT
+	 * are handled with an AF_XDP socket, NULL if the kernel UDP stack is
+	 * used.
+	 */
+	char *xdp_ifname;
+	uint32_t xdp_queue;
+	enum xdp_mode xdp_mode;
+	enum prio_class prio;
+};
+
+/*
+ * Returns a human-readable representation of a config in format
+ * CAN_IFNAME:IN_PORT:OUT_HOST:OUT_PORT.
+ */
+static const char *str_config(const struct config *config)
+{
+	return config->name;
+}
+
+/* Parses an unsigned integer option value. Returns -1 on error. */
+static long long parse_uint(const char *value, unsigned long long max)
+{
+	char *end;
+	if (!value || *value == '\0' || *value == '-')
+		return -1;
+	errno = 0;
+	unsigned long long v = strtoull(value, &end, 0);
+	if (errno != 0 || *end != '\0' || v > max)
+		return -1;
+	return v;
+}
+
+/*
+ * Option handlers. Each handler takes an option value (NULL if the option was
+ * given without a value) and returns 0 on success, -1 on invalid value.
+ */
+
+static int parse_opt_j1939(struct config *config, const char *value)
+{
+	config->can_proto = CAN_PROTO_J1939;
+	if (value) {
+		long long addr = parse_uint(value, J1939_MAX_UNICAST_ADDR);
+		if (addr < 0)
+			return -1;
+		config->j1939_addr = addr;
+	}
+	return 0;
+}
+
+static int parse_opt_err_frames(struct config *config, const char *value)
+{
+	if (value)
+		return -1;
+	config->forward_err_frames = true;
+	return 0;
+}
+
+static int parse_opt_quiet(struct config *config, const char *value)
+{
+	if (value)
+		return -1;
+	config->quiet = true;
+	return 0;
+}
+
+static int parse_opt_tx_stamps(struct config *config, const char *value)
+{
+	if (value)
+		return -1;
+	config->tx_stamps = true;
+	return 0;
+}
+
+static int parse_opt_txtime(struct config *config, const char *value)
+{
+	/* Don't allow scheduling frames more than 10 seconds ahead. */
+	long long offset = parse_uint(value, 10000000);
+	if (offset < 0)
+		return -1;
+	config->txtime = true;
+	config->txtime_offset_us = offset;
+	return 0;
+}
+
+/*
+ * Parses a cyclic frame in format PERIOD_MS:FRAME[:udp] and adds it to
+ * a config. Returns 0 on success, -1 on invalid input.
+ */
+static int add_cyclic_spec(struct config *config, const char *value)
+{
+	if (!value)
+		return -1;
+	char *s = xstrdup(value);
+	struct cyclic_spec spec;
+	memset(&spec, 0, sizeof(spec));
+	char *frame_str = strchr(s, ':');
+	if (!frame_str)
+		goto fail;
+	*frame_str++ = '\0';
+	char *dest = strchr(frame_str, ':');
+	if (dest) {
+		*dest++ = '\0';
+		if (strcmp(dest, "udp") == 0)
+			spec.to_udp = true;
+		else if (strcmp(dest, "can") != 0)
+			goto fail;
+	}
+	long long period = parse_uint(s, CYCLIC_MAX_PERIOD_MS);
+	if (period <= 0 || parse_can_frame(frame_str, &spec.frame) != 0)
+		goto fail;
+	spec.period_ms = period;
+	config->cyclic = xrealloc(config->cyclic,
+			sizeof(*config->cyclic) * (config->n_cyclic + 1));
+	config->cyclic[config->n_cyclic++] = spec;
+	free(s);
+	return 0;
+fail:
+	free(s);
+	return -1;
+}
+
+static int parse_opt_cyclic(struct config *config, const char *value)
+{
+	return add_cyclic_spec(config, value);
+}
+
+/* Parses a CAN id range in format FIRST[-LAST], in hex. */
+static int parse_can_id_range(char *s, struct can_id_range *range)
+{
+	char *last = strchr(s, '-');
+	if (last)
+		*last++ = '\0';
+	char *end;
+	if (*s == '\0' || *s == '+' || *s == '-')
+		return -1;
+	range->first = strtoul(s, &end, 16);
+	if (*end != '\0' || range->first > CAN_EFF_MASK)
+		return -1;
+	range->last = range->first;
+	if (last) {
+		if (*last == '\0' || *last == '+' || *last == '-')
+			return -1;
+		range->last = strtoul(last, &end, 16);
+		if (*end != '\0' || range->last > CAN_EFF_MASK ||
+				range->last < range->first)
+			return -1;
+	}
+	return 0;
+}
+
+/* Parses a qos option: FIRST[-LAST]:DSCP[:PRIORITY]. */
+static int parse_opt_qos(struct config *config, const char *value)
+{
+	if (!value || config->n_qos == QOS_MAX_CLASSES)
+		return -1;
+	char *s = xstrdup(value);
+	struct qos_class qos;
+	char *dscp = strchr(s, ':');
+	if (!dscp)
+		goto fail;
+	*dscp++ = '\0';
+	char *priority = strchr(dscp, ':');
+	if (priority)
+		*priority++ = '\0';
+	long long v = parse_uint(dscp, 63);
+	if (parse_can_id_range(s, &qos.ids) != 0 || v < 0)
+		goto fail;
+	qos.dscp = v;
+	qos.priority = -1;
+	if (priority) {
+		if ((v = parse_uint(priority, INT_MAX)) < 0)
+			goto fail;
+		qos.priority = v;
+	}
+	config->qos = xrealloc(config->qos,
+			sizeof(*config->qos) * (config->n_qos + 1));
+	config->qos[config->n_qos++] = qos;
+	free(s);
+	return 0;
+fail:
+	free(s);
+	return -1;
+}
+
+/*
+ * Reads cyclic frames from a file, one PERIOD_MS:FRAME[:udp] per line.
+ * Empty lines and lines starting with '#' are ignored.
+ */
+static int parse_opt_cyclic_file(struct config *config, const char *value)
+{
+	if (!value)
+		return -1;
+	FILE *f = fopen(value, "r");
+	if (!f)
+		fail("Failed to open '%s'", value);
+	char line[256];
+	int line_no = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line_no++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		if (add_cyclic_spec(config, line) != 0) {
+			fclose(f);
+			failx("%s:%d: Invalid cyclic frame '%s'",
+					value, line_no, line);
+		}
+	}
+	bool failed = ferror(f);
+	fclose(f);
+	if (failed)
+		failx("Failed to read '%s'", value);
+	return 0;
+}
+
+static int parse_opt_heartbeat(struct config *config, const char *value)
+{
+	long long interval = parse_uint(value, 3600 * 1000);
+	if (interval <= 0)
+		return -1;
+	config->heartbeat_ms = interval;
+	return 0;
+}
+
+static int parse_opt_peers(struct config *config, const char *value)
+{
+	long long n = parse_uint(value, 1024);
+	if (n <= 0)
+		return -1;
+	config->max_peers = n;
+	return 0;
+}
+
+static int parse_opt_peer_ttl(struct config *config, const char *value)
+{
+	long long ttl = parse_uint(value, 24 * 3600);
+	if (ttl <= 0)
+		return -1;
+	config->peer_ttl_s = ttl;
+	return 0;
+}
+
+/*
+ * Parses an IPv4 or IPv6 prefix in format ADDR[/LEN]. Returns 0 on success,
+ * -1 on invalid input.
+ */
+static int parse_ip_prefix(const char *s, struct ip_prefix *prefix)
+{
+	char buf[INET6_ADDRSTRLEN + 4];
+	if (strlen(s) >= sizeof(buf))
+		return -1;
+	strcpy(buf, s);
+	long long len = -1;
+	char *slash = strchr(buf, '/');
+	if (slash) {
+		*slash = '\0';
+		len = parse_uint(slash + 1, 128);
+		if (len < 0)
+			return -1;
+	}
+	struct in_addr addr4;
+	memset(prefix, 0, sizeof(*prefix));
+	if (inet_pton(AF_INET, buf, &addr4) == 1) {
+		if (len > 32)
+			return -1;
+		prefix->addr.s6_addr[10] = 0xff;
+		prefix->addr.s6_addr[11] = 0xff;
+		memcpy(&prefix->addr.s6_addr[12], &addr4, 4);
+		prefix->len = 96 + (len < 0 ? 32 : len);
+	} else if (inet_pton(AF_INET6, buf, &prefix->addr) == 1) {
+		prefix->len = len < 0 ? 128 : len;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_opt_allow(struct config *config, const char *value)
+{
+	struct ip_prefix prefix;
+	if (!value || parse_ip_prefix(value, &prefix) != 0)
+		return -1;
+	config->allow = xrealloc(config->allow,
+			sizeof(*config->allow) * (config->n_allow + 1));
+	config->allow[config->n_allow++] = prefix;
+	return 0;
+}
+
+static int parse_opt_allow_kernel(struct config *config, const char *value)
+{
+	if (value)
+		return -1;
+	config->allow_kernel = true;
+	return 0;
+}
+
+static int parse_opt_auth(struct config *config, const char *value)
+{
+	if (!value || *value == '\0')
+		return -1;
+	config->auth_key_file = xstrdup(value);
+	return 0;
+}
+
+static int parse_opt_auth_max_skew(struct config *config, const char *value)
+{
+	long long ms = parse_uint(value, 86400000);
+	if (ms <= 0)
+		return -1;
+	config->auth_max_skew_ms = ms;
+	return 0;
+}
+
+static int parse_opt_batch(struct config *config, const char *value)
+{
+	long long batch = parse_uint(value, MAX_BATCH);
+	if (batch <= 0)
+		return -1;
+	config->batch = batch;
+	return 0;
+}
+
+static int parse_opt_batch_latency(struct config *config, const char *value)
+{
+	long long latency_us = parse_uint(value, 1000000);
+	if (latency_us <= 0)
+		return -1;
+	config->batch_latency_us = latency_us;
+	return 0;
+}
+
+/* Parses a percentage into a probability scaled to 2^32. */
+static int parse_percent(const char *value, uint64_t *probability)
+{
+	char *end;
+	if (!value || *value == '\0')
+		return -1;
+	errno = 0;
+	double percent = strtod(value, &end);
+	if (errno != 0 || *end != '\0' || !(percent >= 0 && percent <= 100))
+		return -1;
+	*probability = percent / 100 * (1ULL << 32);
+	return 0;
+}
+
+static int parse_opt_impair_loss(struct config *config, const char *value)
+{
+	return parse_percent(value, &config->impair.loss);
+}
+
+static int parse_opt_impair_dup(struct config *config, const char *value)
+{
+	return parse_percent(value, &config->impair.dup);
+}
+
+static int parse_opt_impair_reorder(struct config *config, const char *value)
+{
+	return parse_percent(value, &config->impair.reorder);
+}
+
+/* Parses a delay in format MS[:JITTER_MS[:uniform|normal]]. */
+static int parse_opt_impair_delay(struct config *config, const char *value)
+{
+	if (!value)
+		return -1;
+	char *s = xstrdup(value);
+	char *delay = strsep(&s, ":");
+	char *jitter = strsep(&s, ":");
+	char *dist = s;
+	long long delay_ms = parse_uint(delay, IMPAIR_MAX_DELAY_MS);
+	long long jitter_ms = jitter ? parse_uint(jitter,
+			IMPAIR_MAX_DELAY_MS) : 0;
+	int rc = -1;
+	if (delay_ms < 0 || jitter_ms < 0)
+		goto out;
+	if (!dist || strcmp(dist, "uniform") == 0)
+		config->impair.normal = false;
+	else if (strcmp(dist, "normal") == 0)
+		config->impair.normal = true;
+	else
+		goto out;
+	config->impair.delay_ms = delay_ms;
+	config->impair.jitter_ms = jitter_ms;
+	rc = 0;
+out:
+	free(delay);
+	return rc;
+}
+
+static int parse_opt_impair_rate(struct config *config, const char *value)
+{
+	long long rate = parse_uint(value, UINT32_MAX);
+	if (rate <= 0)
+		return -1;
+	config->impair.rate_kbit = rate;
+	return 0;
+}
+
+static int parse_opt_impair_seed(struct config *config, const char *value)
+{
+	long long seed = parse_uint(value, INT64_MAX);
+	if (seed < 0)
+		return -1;
+	config->impair.seed = seed;
+	return 0;
+}
+
+static int parse_opt_impair_dir(struct config *config, const char *value)
+{
+	if (!value)
+		return -1;
+	if (strcmp(value, "both") == 0)
+		config->impair.dir = IMPAIR_BOTH;
+	else if (strcmp(value, "tx") == 0)
+		config->impair.dir = IMPAIR_TX;
+	else if (strcmp(value, "rx") == 0)
+		config->impair.dir = IMPAIR_RX;
+	else
+		return -1;
+	return 0;
+}
+
+static int parse_opt_xdp(struct config *config, const char *value)
+{
+	if (!value || *value == '\0')
+		return -1;
+	char *ifname = xstrdup(value);
+	char *queue = strchr(ifname, ':');
+	if (queue) {
+		*queue++ = '\0';
+		long long n = parse_uint(queue, UINT32_MAX);
+		if (n < 0 || *ifname == '\0') {
+			free(ifname);
+			return -1;
+		}
+		config->xdp_queue = n;
+	}
+	config->xdp_ifname = ifname;
+	return 0;
+}
+
+static int parse_opt_xdp_mode(struct config *config, const char *value)
+{
+	if (!value)
+		return -1;
+	if (strcmp(value, "auto") == 0)
+		config->xdp_mode = XDP_MODE_AUTO;
+	else if (strcmp(value, "native") == 0)
+		config->xdp_mode = XDP_MODE_NATIVE;
+	else if (strcmp(value, "generic") == 0)
+		config->xdp_mode = XDP_MODE_GENERIC;
+	else
+		return -1;
+	return 0;
+}
+
+static int parse_opt_prio(struct config *config, const char *value)
+{
+	if (!value)
+		return -1;
+	if (strcmp(value, "high") == 0)
+		config->prio = PRIO_HIGH;
+	else if (strcmp(value, "normal") == 0)
+		config->prio = PRIO_NORMAL;
+	else if (strcmp(value, "low") == 0)
+		config->prio = PRIO_LOW;
+	else
+		return -1;
+	return 0;
+}
+
+static int parse_opt_policy(struct config *config, const char *value)
+{
+	if (!value)
+		return -1;
+	if (strcmp(value, "failover") == 0)
+		config->dest_policy = DEST_POLICY_FAILOVER;
+	else if (strcmp(value, "hash") == 0)
+		config->dest_policy = DEST_POLICY_HASH;
+	else
+		return -1;
+	return 0;
+}
+
+/* Parses a can_prio option: FIRST[-LAST]:PRIORITY. */
+static int parse_opt_can_prio(struct config *config, const char *value)
+{
+	if (!value || config->n_can_prio == CAN_PRIO_MAX_CLASSES)
+		return -1;
+	char *s = xstrdup(value);
+	struct can_prio_class class;
+	char *priority = strchr(s, ':');
+	if (!priority)
+		goto fail;
+	*priority++ = '\0';
+	long long v = parse_uint(priority, INT_MAX);
+	if (parse_can_id_range(s, &class.ids) != 0 || v < 0)
+		goto fail;
+	class.priority = v;
+	config->can_prio = xrealloc(config->can_prio,
+			sizeof(*config->can_prio) * (config->n_can_prio + 1));
+	config->can_prio[config->n_can_prio++] = class;
+	free(s);
+	return 0;
+fail:
+	free(s);
+	return -1;
+}
+
+static const struct config_option {
+	const char *name;
+	int (*parse)(struct config *config, const char *value);
+} config_options[] = {
+	{"j1939", parse_opt_j1939},
+	{"err_frames", parse_opt_err_frames},
+	{"quiet", parse_opt_quiet},
+	{"tx_stamps", parse_opt_tx_stamps},
+	{"txtime", parse_opt_txtime},
+	{"cyclic", parse_opt_cyclic},
+	{"cyclic_file", parse_opt_cyclic_file},
+	{"heartbeat", parse_opt_heartbeat},
+	{"qos", parse_opt_qos},
+	{"can_prio", parse_opt_can_prio},
+	{"policy", parse_opt_policy},
+	{"peers", parse_opt_peers},
+	{"peer_ttl", parse_opt_peer_ttl},
+	{"allow", parse_opt_allow},
+	{"allow_kernel", parse_opt_allow_kernel},
+	{"auth", parse_opt_auth},
+	{"auth_max_skew", parse_opt_auth_max_skew},
+	{"batch", parse_opt_batch},
+	{"batch_latency", parse_opt_batch_latency},
+	{"impair_loss", parse_opt_impair_loss},
+	{"impair_dup", parse_opt_impair_dup},
+	{"impair_reorder", parse_opt_impair_reorder},
+	{"impair_delay", parse_opt_impair_delay},
+	{"impair_rate", parse_opt_impair_rate},
+	{"impair_seed", parse_opt_impair_seed},
+	{"impair_dir", parse_opt_impair_dir},
+	{"xdp", parse_opt_xdp},
+	{"xdp_mode", parse_opt_xdp_mode},
+	{"prio", parse_opt_prio},
+};
+
+static void parse_config_option(char *option_str, struct config *config)
+{
+	char *value = strchr(option_str, '=');
+	if (value)
+		*value++ = '\0';
+	for (size_t i = 0; i < sizeof(config_options) /
+			sizeof(config_options[0]); i++) {
+		const struct config_option *opt = &config_options[i];
+		if (strcmp(opt->name, option_str) != 0)
+			continue;
+		if (opt->parse(config, value) != 0) {
+			failx("Invalid value for option '%s': "
+					"'%s'", option_str,
+					value ? value : "");
+		}
+		return;
+	}
+	failx("Unknown option '%s'", option_str);
+}
+
+/*
+ * Initializes a config from a string. The string is given in format
+ * CAN_IFNAME:IN_PORT:OUT_HOST:OUT_PORT[,OPTION[=VALUE]]...
+ */
+static void parse_config(const char *config_str, struct config *config)
+{
+	char *end;
+	char *s = xstrdup(config_str);
+	memset(config, 0, sizeof(*config));
+	config->can_proto = CAN_PROTO_RAW;
+	config->j1939_addr = J1939_NO_ADDR;
+	config->max_peers = 8;
+	config->peer_ttl_s = 60;
+	config->impair.seed = 1;
+	config->prio = PRIO_NORMAL;
+	/* Formatted once rather than by every message. */
+	config->name = xstrdup(config_str);
+	config->name[strcspn(config->name, ",")] = '\0';
+	config->can_ifname = s;
+	end = strchr(s, ':');
+	if (!end) goto fail;
+	*end = '\0';
+	config->in_port = s = end + 1;
+	end = strchr(s, ':');
+	if (!end) goto fail;
+	*end = '\0';
+	config->out_host = s = end + 1;
+	end = strchr(s, ':');
+	if (!end) goto fail;
+	*end = '\0';
+	config->out_port = s = end + 1;
+	end = strchr(s, ',');
+	if (end) {
+		*end = '\0';
+		s = end + 1;
+		char *option_str;
+		while ((option_str = strsep(&s, ",")) != NULL)
+			parse_config_option(option_str, config);
+	}
+	if (strcmp(config->out_host, "*") == 0) {
+		if (strcmp(config->out_port, "*") != 0) {
+			failx("Invalid config: OUT_PORT must be "
+					"'*' if OUT_HOST is '*', got '%s'",
+					config_str);
+		}
+		if (config->heartbeat_ms != 0) {
+			failx("Invalid config: heartbeat can't "
+					"be used with learned peers, got '%s'",
+					config_str);
+		}
+		config->learn_peers = true;
+	}
+	return;
+fail:
+	failx("Invalid config: Expected "
+			"CAN_IFNAME:IN_PORT:OUT_HOST:OUT_PORT[,OPTION[=VALUE]]..., "
+			"got '%s'", config_str);
+}
+
+/* Frees the memory allocated by parse_config(). */
+static void free_config(struct config *config)
+{
+	free(config->name);
+	free(config->can_ifname);
+	free(config->cyclic);
+	free(config->qos);
+	free(config->can_prio);
+	free(config->allow);
+	free(config->auth_key_file);
+	free(config->xdp_ifname);
+}
+
+/*
+ * Hierarchical timer wheel driven by a single timerfd. Each level has
+ * TIMER_WHEEL_SLOTS slots; a slot at level L spans TIMER_WHEEL_SLOTS^L ticks.
+ * Timers are cascaded to lower levels as time advances so that scheduling and
+ * firing a timer is O(1) regardless of the number of timers. Timers that
+ * expire at the same tick fire in the order they were scheduled.
+ */
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+/* Timer wheel resolution. */
+#define TIMER_WHEEL_TICK_NS 1000000ULL
+
+struct timer_wheel;
+
+/* Periodic or one-shot timer scheduled in a timer wheel. */
+struct wheel_timer {
+	/* Next timer in the same slot. */
+	struct wheel_timer *next;
+	/* Tick at which the timer fires next time. */
+	uint64_t expires;
+	/* Timer period in ticks, 0 for a one-shot timer. */
+	uint32_t period;
+	/* Called when the timer fires. */
+	void (*fire)(struct timer_wheel *wheel, struct wheel_timer *timer);
+};
+
+/* List of timers in a timer wheel slot, in the order they fire. */
+struct wheel_slot {
+	struct wheel_timer *head, *tail;
+};
+
+struct timer_wheel {
+	struct wheel_slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	/* Current tick. All timers expiring at or before it have fired. */
+	uint64_t now;
+	/* CLOCK_MONOTONIC time of tick 0. */
+	uint64_t start_ns;
+	/* Tick the timerfd is armed for, 0 if disarmed. */
+	uint64_t armed;
+	/* Number of scheduled timers. */
+	int n_timers;
+	/* Set while timers are being fired. */
+	bool running;
+	int tfd;
+};
+
+/*
+ * Inserts a timer at the head or at the tail of a slot. Timers are inserted at
+ * the tail when scheduled and at the head when cascaded: a cascaded timer was
+ * scheduled before any timer already in the slot that expires at the same
+ * tick, since a timer scheduled earlier lands at a higher level.
+ */
+static void wheel_slot_insert(struct wheel_slot *slot,
+		struct wheel_timer *timer, bool head)
+{
+	if (head) {
+		timer->next = slot->head;
+		slot->head = timer;
+		if (!slot->tail)
+			slot->tail = timer;
+		return;
+	}
+	timer->next = NULL;
+	if (slot->tail)
+		slot->tail->next = timer;
+	else
+		slot->head = timer;
+	slot->tail = timer;
+}
+
+/* Removes all timers from a slot and returns them as a list. */
+static struct wheel_timer *wheel_slot_take(struct wheel_slot *slot)
+{
+	struct wheel_timer *timer = slot->head;
+	slot->head = slot->tail = NULL;
+	return timer;
+}
+
+static void timer_wheel_insert(struct timer_wheel *wheel,
+		struct wheel_timer *timer, bool head)
+{
+	uint64_t delta = timer->expires - wheel->now;
+	assert(timer->expires > wheel->now);
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+			delta >= 1ULL << (TIMER_WHEEL_BITS * (level + 1)))
+		level++;
+	int slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) &
+			TIMER_WHEEL_MASK;
+	wheel_slot_insert(&wheel->slots[level][slot], timer, head);
+}
+
+/*
+ * Schedules a timer. The timer fires for the first time after delay ticks (at
+ * least 1) and then every period ticks, or only once if period is 0.
+ */
+static void timer_wheel_add(struct timer_wheel *wheel,
+		struct wheel_timer *timer, uint32_t delay, uint32_t period)
+{
+	timer->expires = wheel->now + (delay > 0 ? delay : 1);
+	timer->period = period;
+	timer_wheel_insert(wheel, timer, false);
+	wheel->n_timers++;
+}
+
+/* Returns the CLOCK_MONOTONIC time at which a timer was due to fire. */
+static uint64_t timer_wheel_due_ns(const struct timer_wheel *wheel,
+		const struct wheel_timer *timer)
+{
+	return wheel->start_ns + timer->expires * TIMER_WHEEL_TICK_NS;
+}
+
+/* Advances a timer wheel by one tick, firing expired timers. */
+static void timer_wheel_tick(struct timer_wheel *wheel)
+{
+	wheel->now++;
+	for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		int shift = TIMER_WHEEL_BITS * level;
+		if ((wheel->now & ((1ULL << shift) - 1)) != 0)
+			break;
+		int slot = (wheel->now >> shift) & TIMER_WHEEL_MASK;
+		struct wheel_timer *timer = wheel_slot_take(
+				&wheel->slots[level][slot]);
+		/*
+		 * Reverse the list so that inserting each timer at the head of
+		 * its new slot preserves the order.
+		 */
+		struct wheel_timer *reversed = NULL;
+		while (timer) {
+			struct wheel_timer *next = timer->next;
+			timer->next = reversed;
+			reversed = timer;
+			timer = next;
+		}
+		timer = reversed;
+		while (timer) {
+			struct wheel_timer *next = timer->next;
+			if (timer->expires == wheel->now) {
+				/* Expires right now, fire it below. */
+				int now_slot = wheel->now & TIMER_WHEEL_MASK;
+				wheel_slot_insert(&wheel->slots[0][now_slot],
+						timer, true);
+			} else {
+				timer_wheel_insert(wheel, timer, true);
+			}
+			timer = next;
+		}
+	}
+	int slot = wheel->now & TIMER_WHEEL_MASK;
+	struct wheel_timer *timer = wheel_slot_take(&wheel->slots[0][slot]);
+	while (timer) {
+		struct wheel_timer *next = timer->next;
+		if (timer->period == 0) {
+			/* The timer may be scheduled again by fire(). */
+			wheel->n_timers--;
+			timer->fire(wheel, timer);
+		} else {
+			timer->fire(wheel, timer);
+			timer->expires += timer->period;
+			timer_wheel_insert(wheel, timer, false);
+		}
+		timer = next;
+	}
+}
+
+/* Returns true if advancing a timer wheel to tick fires or cascades timers. */
+static bool timer_wheel_busy(const struct timer_wheel *wheel, uint64_t tick)
+{
+	if (wheel->slots[0][tick & TIMER_WHEEL_MASK].head)
+		return true;
+	for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		int shift = TIMER_WHEEL_BITS * level;
+		if ((tick & ((1ULL << shift) - 1)) != 0)
+			break;
+		if (wheel->slots[level][(tick >> shift) & TIMER_WHEEL_MASK].head)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Returns the first tick after the current one, and at most limit, at which a
+ * timer wheel needs to be advanced: one at which a timer expires or timers
+ * cascade. Returns limit if there is none. Past the span of a level, all of
+ * its slots have been checked, so only the ticks at which the level above
+ * cascades are.
+ */
+static uint64_t timer_wheel_next(const struct timer_wheel *wheel,
+		uint64_t limit)
+{
+	uint64_t tick = wheel->now + 1;
+	int level = 0;
+	while (tick < limit) {
+		if (timer_wheel_busy(wheel, tick))
+			return tick;
+		while (level < TIMER_WHEEL_LEVELS - 1 && tick - wheel->now >=
+				1ULL << (TIMER_WHEEL_BITS * (level + 1)))
+			level++;
+		tick = (tick | ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) + 1;
+	}
+	return limit;
+}
+
+/*
+ * Arms the timerfd of a timer wheel for the next tick that needs work, or
+ * disarms it if the wheel is empty, so that an idle wheel doesn't wake up for
+ * every cascade.
+ */
+static void timer_wheel_arm(struct timer_wheel *wheel)
+{
+	uint64_t next = 0;
+	if (wheel->n_timers > 0) {
+		next = timer_wheel_next(wheel, wheel->now +
+				(1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)));
+	}
+	if (next == wheel->armed)
+		return;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (next > 0) {
+		uint64_t expires_ns = wheel->start_ns +
+				next * TIMER_WHEEL_TICK_NS;
+		its.it_value.tv_sec = expires_ns / 1000000000;
+		its.it_value.tv_nsec = expires_ns % 1000000000;
+	}
+	if (timerfd_settime(wheel->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		fail("timerfd_settime");
+	wheel->armed = next;
+}
+
+static struct timer_wheel *timer_wheel_create(void)
+{
+	struct timer_wheel *wheel = arena_alloc(sizeof(*wheel));
+	wheel->start_ns = now_ns();
+	wheel->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (wheel->tfd == -1)
+		fail("timerfd_create");
+	own_fd(wheel->tfd);
+	return wheel;
+}
+
+/* Advances a timer wheel to the current time, firing expired timers. */
+static void timer_wheel_advance(struct timer_wheel *wheel)
+{
+	uint64_t target = (now_ns() - wheel->start_ns) / TIMER_WHEEL_TICK_NS;
+	if (wheel->n_timers == 0) {
+		/* Nothing to fire or cascade on the way. */
+		wheel->now = target;
+		return;
+	}
+	/*
+	 * Jump over the ticks with nothing to fire or cascade, which may be
+	 * many after the process was stopped or suspended.
+	 */
+	wheel->running = true;
+	while (wheel->now < target) {
+		wheel->now = timer_wheel_next(wheel, target) - 1;
+		timer_wheel_tick(wheel);
+	}
+	wheel->running = false;
+}
+
+/* Handles timerfd expiration: runs the timer wheel up to the current time. */
+static void timer_wheel_run(struct timer_wheel *wheel)
+{
+	uint64_t expirations;
+	if (read(wheel->tfd, &expirations, sizeof(expirations)) == -1 &&
+			errno != EAGAIN)
+		fail("timerfd read");
+	wheel->armed = 0;
+	timer_wheel_advance(wheel);
+	timer_wheel_arm(wheel);
+}
+
+/*
+ * Schedules a one-shot timer to fire at a CLOCK_MONOTONIC time. May be called
+ * both from timer callbacks and from outside the timer wheel, but only
+ * timer_wheel_run() fires timers: outside of it, the timer is inserted
+ * relative to the last tick the wheel was advanced to, and the timerfd is
+ * re-armed if the timer is due earlier than the next tick that needs work.
+ */
+static void timer_wheel_add_at(struct timer_wheel *wheel,
+		struct wheel_timer *timer, uint64_t time_ns)
+{
+	if (!wheel->running && wheel->n_timers == 0) {
+		/* Nothing to fire on the way, skip the idle ticks. */
+		wheel->now = (now_ns() - wheel->start_ns) /
+				TIMER_WHEEL_TICK_NS;
+	}
+	uint64_t tick = (time_ns - wheel->start_ns + TIMER_WHEEL_TICK_NS - 1) /
+			TIMER_WHEEL_TICK_NS;
+	timer_wheel_add(wheel, timer,
+			tick > wheel->now ? tick - wheel->now : 1, 0);
+	if (!wheel->running)
+		timer_wheel_arm(wheel);
+}
+
+/* Interval between UDP->CAN send attempts while the bus is off. */
+#define BUS_OFF_PROBE_INTERVAL_NS 1000000000ULL
+
+/* Error state of a CAN controller below bus-off, see ISO 11898-1. */
+enum can_err_state {
+	CAN_ERR_STATE_ACTIVE,
+	CAN_ERR_STATE_WARNING,
+	CAN_ERR_STATE_PASSIVE,
+};
+
+static const char *const can_err_state_names[] = {
+	[CAN_ERR_STATE_ACTIVE] = "error-active",
+	[CAN_ERR_STATE_WARNING] = "error-warning",
+	[CAN_ERR_STATE_PASSIVE] = "error-passive",
+};
+
+/* CAN controller error statistics. */
+struct can_error_stats {
+	/* Number of error frames received, by class. */
+	uint64_t bus_off;
+	uint64_t error_passive;
+	uint64_t error_warning;
+	uint64_t arbitration_lost;
+	uint64_t tx_timeout;
+	uint64_t bus_error;
+	uint64_t overflow;
+	uint64_t restarted;
+	/* Number of UDP->CAN frames dropped because the bus was off. */
+	uint64_t dropped_bus_off;
+	/* Number of times the bus recovered from the bus-off state. */
+	uint64_t recoveries;
+	/* Total and max time spent in the bus-off state. */
+	uint64_t bus_off_total_ns;
+	uint64_t bus_off_max_ns;
+};
+
+/* Interval between probes sent to a dead peer if heartbeats are disabled. */
+#define PEER_PROBE_INTERVAL_NS 1000000000ULL
+/* Number of missed heartbeats after which the peer is considered dead. */
+#define PEER_TIMEOUT_HEARTBEATS 3
+
+/* Liveness of a peer at OUT_HOST. */
+struct peer_state {
+	/* Set if CAN->UDP traffic to the peer is suppressed. */
+	bool dead;
+	/*
+	 * Set if the peer was declared dead because it stopped sending
+	 * heartbeats rather than because it refused our packets. Such a peer
+	 * is revived only by receiving a packet from it.
+	 */
+	bool timed_out;
+	/* Set if a probe was sent and may still be refused. */
+	bool probe_pending;
+	/*
+	 * Set if a packet sent from in_sfd was refused since the last probe,
+	 * see read_udp_errqueue().
+	 */
+	bool refused;
+	/* Time a packet was last received on IN_PORT. */
+	uint64_t last_rx_ns;
+	/* Time the last probe was sent. */
+	uint64_t last_probe_ns;
+	/* Time the peer was declared dead. */
+	uint64_t dead_since_ns;
+	/* Sends heartbeats and probes, if heartbeats are enabled. */
+	struct wheel_timer heartbeat_timer;
+	/* Statistics. */
+	uint64_t heartbeats_sent;
+	uint64_t probes_sent;
+	uint64_t deaths;
+	uint64_t dead_total_ns;
+};
+
+struct connection;
+struct allowlist;
+struct xdp_socket;
+
+/* UDP destination CAN frames are forwarded to. */
+struct destination {
+	struct connection *conn;
+	/* Host and port as given in the config. */
+	char *host, *port;
+	/*
+	 * Socket fd packets are sent from: in_sfd if the destination is learned
+	 * or has the address family of in_sfd, otherwise a socket of its own
+	 * connected to the destination.
+	 */
+	int sfd;
+	/* Address of the destination. */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	/* Set if the destination was learned from packets received on IN_PORT. */
+	bool learned;
+	/* Time a packet was last received from a learned destination. */
+	uint64_t last_seen_ns;
+	/* Storage of host and port of a learned destination. */
+	char learned_host[INET6_ADDRSTRLEN + IF_NAMESIZE + 1];
+	char learned_port[sizeof("65535")];
+	/*
+	 * Source port of packets sent with AF_XDP, in network byte order. The
+	 * port of sfd, or IN_PORT if learned.
+	 */
+	uint16_t src_port;
+	struct peer_state peer;
+	/* Number of packets sent. */
+	uint64_t sent;
+};
+
+/*
+ * Number of UDP->CAN frames that may await a TX timestamp. Older frames are
+ * forgotten.
+ */
+#define TX_STAMP_RING_SIZE 256
+
+/* UDP->CAN frame awaiting a TX timestamp. */
+struct tx_stamp_entry {
+	/* Timestamp key assigned by the kernel (SOF_TIMESTAMPING_OPT_ID). */
+	uint32_t key;
+	/* Time the frame arrived to the UDP socket. */
+	uint64_t arrival_ns;
+	/* Time the frame was passed to send(). */
+	uint64_t send_ns;
+	/* Time the frame entered the qdisc, 0 if not yet known. */
+	uint64_t sched_ns;
+};
+
+/*
+ * UDP->CAN latency measured with socket TX timestamps. All times are
+ * CLOCK_REALTIME, which is what the kernel uses for software timestamps.
+ */
+struct tx_stamp_state {
+	struct tx_stamp_entry ring[TX_STAMP_RING_SIZE];
+	/* Key that will be assigned to the next sent frame. */
+	uint32_t next_key;
+	/* From UDP arrival to send(). */
+	struct histogram udpcan;
+	/* From entering the qdisc to leaving the driver. */
+	struct histogram qdisc;
+	/* From UDP arrival to leaving the driver. */
+	struct histogram total;
+	/* Number of timestamps that didn't match any sent frame. */
+	uint64_t unmatched;
+};
+
+/* Version of the authenticated datagram format. */
+#define AUTH_VERSION 1
+/* Size of the MAC that trails an authenticated datagram. */
+#define AUTH_MAC_SIZE 8
+/* Size of a CAN frame record: CAN id, length, data. */
+#define AUTH_RECORD_MAX_SIZE (4 + 1 + PACKED_CAN_FRAME_MAX_DATA_SIZE)
+#define AUTH_MAX_DATAGRAM_SIZE (sizeof(struct auth_hdr) + \
+		MAX_BATCH * AUTH_RECORD_MAX_SIZE + AUTH_MAC_SIZE)
+/* Number of senders whose replay windows are tracked. */
+#define AUTH_MAX_SENDERS 16
+/* Number of sequence numbers below the highest one that are accepted. */
+#define AUTH_REPLAY_WINDOW 64
+
+/*
+ * Header of an authenticated datagram. Followed by n_frames CAN frame records
+ * (4-byte CAN id, 1-byte length, data) and a SipHash-2-4 MAC of everything
+ * before it. All values are in the network byte order.
+ */
+struct auth_hdr {
+	uint8_t version;
+	uint8_t n_frames;
+	uint16_t reserved;
+	/* Chosen at random by the sender on startup. */
+	uint32_t sender_id;
+	/* Incremented for each datagram. */
+	uint64_t seq;
+};
+
+/* Sequence numbers seen from one sender. */
+struct auth_window {
+	bool used;
+	uint32_t sender_id;
+	/* Highest sequence number accepted. */
+	uint64_t max_seq;
+	/* Bit N is set if sequence number max_seq - N was accepted. */
+	uint64_t bitmap;
+	/* Time a datagram was last accepted. */
+	uint64_t last_ns;
+};
+
+/* Authenticated tunnel state of a connection. */
+struct auth_state {
+	/* SipHash key. */
+	uint64_t key[2];
+	uint32_t sender_id;
+	/*
+	 * Sequence number of the next sent datagram. It follows the wall
+	 * clock, in nanoseconds, so that it keeps increasing across restarts.
+	 */
+	uint64_t seq;
+	/*
+	 * Max distance of received sequence numbers from the wall clock, 0 if
+	 * unchecked. Replay windows don't survive a restart, this bounds the
+	 * age of datagrams that can be replayed after one.
+	 */
+	uint64_t max_skew_ns;
+	struct auth_window windows[AUTH_MAX_SENDERS];
+	/*
+	 * Highest sequence number of an evicted window. Unknown senders must
+	 * start above it, otherwise evicted senders could be replayed.
+	 */
+	uint64_t evicted_seq;
+	/* Buffers for CAN frames read from can_sfd with recvmmsg(). */
+	struct can_frame can_frames[MAX_BATCH];
+	struct iovec can_iovs[MAX_BATCH];
+	struct mmsghdr can_msgs[MAX_BATCH];
+	/* CAN frames unpacked from a received datagram. */
+	struct can_frame udp_frames[MAX_BATCH];
+	uint8_t tx_buf[AUTH_MAX_DATAGRAM_SIZE];
+	uint8_t rx_buf[AUTH_MAX_DATAGRAM_SIZE];
+	/* Statistics. */
+	uint64_t tx_datagrams, tx_frames, tx_mac_ns;
+	uint64_t rx_datagrams, rx_frames, rx_mac_ns;
+	uint64_t bad_mac, replayed, skewed, malformed, evicted;
+};
+
+#define SIPHASH_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPHASH_ROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = SIPHASH_ROTL(v1, 13); v1 ^= v0; \
+	v0 = SIPHASH_ROTL(v0, 32); \
+	v2 += v3; v3 = SIPHASH_ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = SIPHASH_ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = SIPHASH_ROTL(v1, 17); v1 ^= v2; \
+	v2 = SIPHASH_ROTL(v2, 32); \
+} while (0)
+
+/* SipHash-2-4 of a buffer. */
+static uint64_t siphash24(const uint64_t key[2], const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = p + (size & ~(size_t)7);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+	for (; p != end; p += 8) {
+		uint64_t m;
+		memcpy(&m, p, sizeof(m));
+		m = le64toh(m);
+		v3 ^= m;
+		SIPHASH_ROUND(v0, v1, v2, v3);
+		SIPHASH_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	uint64_t b = (uint64_t)size << 56;
+	for (size_t i = 0; i < (size & 7); i++)
+		b |= (uint64_t)p[i] << (8 * i);
+	v3 ^= b;
+	SIPHASH_ROUND(v0, v1, v2, v3);
+	SIPHASH_ROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	for (int i = 0; i < 4; i++)
+		SIPHASH_ROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Packs CAN frames into an authenticated datagram in auth->tx_buf. A datagram
+ * without frames is a heartbeat. Returns the size of the datagram.
+ */
+static size_t auth_seal(struct auth_state *auth,
+		const struct can_frame *frames, int n_frames)
+{
+	assert(n_frames <= MAX_BATCH);
+	uint8_t *p = auth->tx_buf;
+	/* Catch up with the clock after idle periods. */
+	uint64_t now = now_realtime_ns();
+	if (auth->seq < now)
+		auth->seq = now;
+	struct auth_hdr hdr = {
+		.version = AUTH_VERSION,
+		.n_frames = n_frames,
+		.sender_id = htonl(auth->sender_id),
+		.seq = htobe64(auth->seq++),
+	};
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	for (int i = 0; i < n_frames; i++) {
+		uint32_t can_id = htonl(frames[i].can_id);
+		uint8_t len = frames[i].can_dlc;
+		assert(len <= PACKED_CAN_FRAME_MAX_DATA_SIZE);
+		memcpy(p, &can_id, sizeof(can_id));
+		p[4] = len;
+		memcpy(p + 5, frames[i].data, len);
+		p += 5 + len;
+	}
+	uint64_t start_ns = now_ns();
+	uint64_t mac = htobe64(siphash24(auth->key, auth->tx_buf,
+			p - auth->tx_buf));
+	auth->tx_mac_ns += now_ns() - start_ns;
+	memcpy(p, &mac, sizeof(mac));
+	p += sizeof(mac);
+	auth->tx_datagrams++;
+	auth->tx_frames += n_frames;
+	return p - auth->tx_buf;
+}
+
+/*
+ * Checks a sequence number against the replay window of its sender and marks
+ * it as seen. Returns false if the sequence number was seen before or is too
+ * old to tell.
+ */
+static bool auth_window_accept(struct auth_state *auth, uint32_t sender_id,
+		uint64_t seq)
+{
+	struct auth_window *win = NULL;
+	struct auth_window *lru = &auth->windows[0];
+	for (int i = 0; i < AUTH_MAX_SENDERS; i++) {
+		struct auth_window *w = &auth->windows[i];
+		if (w->used && w->sender_id == sender_id) {
+			win = w;
+			break;
+		}
+		if (lru->used && (!w->used || w->last_ns < lru->last_ns))
+			lru = w;
+	}
+	if (!win) {
+		if (seq <= auth->evicted_seq)
+			return false;
+		win = lru;
+		if (win->used) {
+			if (win->max_seq > auth->evicted_seq)
+				auth->evicted_seq = win->max_seq;
+			auth->evicted++;
+		}
+		win->used = true;
+		win->sender_id = sender_id;
+		win->max_seq = seq;
+		win->bitmap = 1;
+	} else if (seq > win->max_seq) {
+		uint64_t shift = seq - win->max_seq;
+		win->bitmap = shift < AUTH_REPLAY_WINDOW ?
+				win->bitmap << shift | 1 : 1;
+		win->max_seq = seq;
+	} else {
+		uint64_t age = win->max_seq - seq;
+		if (age >= AUTH_REPLAY_WINDOW ||
+				(win->bitmap & (1ULL << age)))
+			return false;
+		win->bitmap |= 1ULL << age;
+	}
+	win->last_ns = now_ns();
+	return true;
+}
+
+/*
+ * Verifies an authenticated datagram in auth->rx_buf and unpacks its CAN
+ * frames to auth->udp_frames. Returns the number of frames, or -1 if the
+ * datagram is rejected.
+ */
+static int auth_open(struct auth_state *auth, size_t size)
+{
+	const uint8_t *p = auth->rx_buf;
+	struct auth_hdr hdr;
+	if (size < sizeof(hdr) + AUTH_MAC_SIZE) {
+		auth->malformed++;
+		return -1;
+	}
+	const uint8_t *end = p + size - AUTH_MAC_SIZE;
+	uint64_t mac;
+	memcpy(&mac, end, sizeof(mac));
+	uint64_t start_ns = now_ns();
+	bool mac_ok = be64toh(mac) == siphash24(auth->key, p, end - p);
+	auth->rx_mac_ns += now_ns() - start_ns;
+	if (!mac_ok) {
+		auth->bad_mac++;
+		return -1;
+	}
+	memcpy(&hdr, p, sizeof(hdr));
+	p += sizeof(hdr);
+	if (hdr.version != AUTH_VERSION || hdr.n_frames > MAX_BATCH) {
+		auth->malformed++;
+		return -1;
+	}
+	for (int i = 0; i < hdr.n_frames; i++) {
+		struct can_frame *frame = &auth->udp_frames[i];
+		uint32_t can_id;
+		if (end - p < 5 || p[4] > PACKED_CAN_FRAME_MAX_DATA_SIZE ||
+				end - p < 5 + p[4]) {
+			auth->malformed++;
+			return -1;
+		}
+		memcpy(&can_id, p, sizeof(can_id));
+		frame->can_id = ntohl(can_id);
+		frame->can_dlc = p[4];
+		memcpy(frame->data, p + 5, p[4]);
+		p += 5 + p[4];
+	}
+	if (p != end) {
+		auth->malformed++;
+		return -1;
+	}
+	if (auth->max_skew_ns != 0) {
+		uint64_t seq = be64toh(hdr.seq);
+		uint64_t now = now_realtime_ns();
+		if ((seq < now ? now - seq : seq - now) > auth->max_skew_ns) {
+			auth->skewed++;
+			return -1;
+		}
+	}
+	if (!auth_window_accept(auth, ntohl(hdr.sender_id),
+			be64toh(hdr.seq))) {
+		auth->replayed++;
+		return -1;
+	}
+	auth->rx_datagrams++;
+	auth->rx_frames += hdr.n_frames;
+	return hdr.n_frames;
+}
+
+/* Max size of a datagram held by the impairment stage. */
+#define IMPAIR_MAX_PACKET_SIZE 2048
+/* Max number of datagrams held by the impairment stage per connection. */
+#define IMPAIR_MAX_QUEUED 1024
+
+struct impairment;
+
+/* Datagram passed to a UDP->CAN handler other than through in_sfd. */
+struct udp_datagram {
+	const void *data;
+	/* Size of the datagram, which may exceed len if data is truncated. */
+	size_t size, len;
+	const struct sockaddr_storage *src;
+	socklen_t src_len;
+};
+
+/* Datagram held by the impairment stage. */
+struct impair_packet {
+	/* Fires when the datagram is released. */
+	struct wheel_timer timer;
+	struct impair_path *path;
+	/* Next packet in the free list. */
+	struct impair_packet *next_free;
+	/* Destination selection key of a datagram sent to OUT_HOST. */
+	uint32_t key;
+	/* Size of the datagram, which may exceed the size of data. */
+	size_t size;
+	/* Source of a datagram received on IN_PORT. */
+	struct sockaddr_storage src;
+	socklen_t src_len;
+	uint8_t data[IMPAIR_MAX_PACKET_SIZE];
+};
+
+/* One direction of the impairment stage. */
+struct impair_path {
+	struct impairment *imp;
+	/* Set for datagrams received on IN_PORT. */
+	bool rx;
+	/* Random number generator state. */
+	uint64_t rng;
+	/* Time the simulated link finishes sending queued datagrams. */
+	uint64_t busy_until_ns;
+	/* Statistics. */
+	uint64_t passed, lost, duplicated, reordered, overflow;
+};
+
+/* Simulated bad network between udpcan and its peers. */
+struct impairment {
+	struct connection *conn;
+	struct timer_wheel *wheel;
+	/* Set if datagrams sent to OUT_HOST are impaired. */
+	bool tx_enabled;
+	struct impair_path tx, rx;
+	struct impair_packet *packets;
+	struct impair_packet *free_packets;
+	/* Handler of datagrams released to IN_PORT. */
+	void (*udp_to_can)(struct connection *conn);
+};
+
+/*
+ * Adaptive CAN->UDP batching, set up with the batch_latency option. After each
+ * read of can_sfd, the number of frames read at once is grown by one if the
+ * read filled the batch, and halved if handling the batch took longer than the
+ * latency bound (AIMD). When frames arrive too fast to be forwarded one by one
+ * cheaply but don't queue up by themselves, can_sfd is not read for as long as
+ * it takes to fill a batch, within the latency bound, so that frames go out in
+ * fewer, fuller batches. Each pause takes two epoll_ctl() calls to stop and
+ * resume watching can_sfd, so pauses are only taken if they save more reads.
+ */
+struct batch_ctl {
+	/* Resumes reading can_sfd at the end of a pause. */
+	struct wheel_timer timer;
+	struct connection *conn;
+	struct timer_wheel *wheel;
+	/* Epoll fd can_sfd is registered with, and its epoll data. */
+	int epfd;
+	uint64_t epoll_data;
+	uint64_t latency_ns;
+	/* Time of the last read. */
+	uint64_t read_ns;
+	/*
+	 * Moving averages of the time between frames, of the handler time per
+	 * frame and of the number of frames per read scaled by 16.
+	 */
+	uint64_t interval_ns;
+	uint64_t cost_ns;
+	uint32_t depth;
+	/* Length of the last pause, 0 if can_sfd was read right away. */
+	uint64_t pause_ns;
+	/* Statistics. */
+	uint64_t grown, shrunk, pauses;
+};
+
+/* Room for the DSCP and the SO_PRIORITY control messages of a packet. */
+#define QOS_CONTROL_SIZE (CMSG_SPACE(sizeof(int)) * 2)
+
+/*
+ * Marking of UDP packets by CAN id class, set up with the qos option. The
+ * marking goes with each packet as control messages, so all classes share the
+ * sockets, and the source port, of the connection.
+ */
+struct qos_state {
+	/* Control messages of each class, for IPv4 and IPv6 destinations. */
+	CMSG_BUFFER(control[QOS_MAX_CLASSES][2], QOS_CONTROL_SIZE);
+	size_t controllen[QOS_MAX_CLASSES][2];
+	/* Set once the kernel rejected SO_PRIORITY as a control message. */
+	bool no_priority;
+	/* Number of packets sent per class. */
+	uint64_t sent[QOS_MAX_CLASSES];
+};
+
+/*
+ * State of the can_prio option. UDP->CAN frames carry the SO_PRIORITY of
+ * their class as a control message, so that a prio or mqprio qdisc on the CAN
+ * interface can send urgent frames ahead of bulk ones.
+ */
+struct can_prio_state {
+	/* Set once the kernel rejected SO_PRIORITY as a control message. */
+	bool no_priority;
+	/* Number of frames sent per class. */
+	uint64_t sent[CAN_PRIO_MAX_CLASSES];
+};
+
+struct connection {
+	struct config config;
+	/* Index of the connection on the command line, used in tracepoints. */
+	int id;
+	/* CAN socket fd. */
+	int can_sfd;
+	/* Socket fd for incoming CAN frames. */
+	int in_sfd;
+	/* Address family of in_sfd. */
+	sa_family_t in_family;
+	/*
+	 * Destinations to forward CAN frames to. If peers are learned, the
+	 * array has room for max_peers destinations.
+	 */
+	struct destination *dests;
+	int n_dests;
+	/* Time learned peers were last checked for expiry. */
+	uint64_t peers_expired_ns;
+	/* NULL unless the allow option is set. */
+	struct allowlist *allowlist;
+	/* NULL unless the auth option is set. */
+	struct auth_state *auth;
+	/* NULL unless impairments are configured. */
+	struct impairment *impair;
+	/* Buffers of can_to_udp(), NULL if another handler is used. */
+	struct can_batch *can_batch;
+	/*
+	 * Max number of CAN frames read from can_sfd at once, and number read
+	 * by the last call of can_to_udp.
+	 */
+	uint32_t batch_size;
+	int batch_read;
+	/* NULL unless the batch_latency option is set. */
+	struct batch_ctl *batch_ctl;
+	/* NULL unless the qos option is set. */
+	struct qos_state *qos;
+	/* NULL unless the can_prio option is set. */
+	struct can_prio_state *can_prio;
+	/* Datagram returned by recv_udp() instead of reading in_sfd. */
+	const struct udp_datagram *rx_datagram;
+	/* NULL unless the xdp option is set. */
+	struct xdp_socket *xdp;
+	/* IN_PORT in network byte order, set with the xdp option. */
+	uint16_t xdp_port;
+	/* Number of packets dropped because all destinations were dead. */
+	uint64_t suppressed;
+	/* Forwards data from can_sfd to OUT_HOST. */
+	void (*can_to_udp)(struct connection *conn);
+	/* Forwards data from in_sfd to can_sfd. */
+	void (*udp_to_can)(struct connection *conn);
+	/* Last J1939 priority set on can_sfd. */
+	int j1939_send_prio;
+	/* Set if the CAN controller is in the bus-off state. */
+	bool bus_off;
+	/* Error state reported by the last error frame that changed it. */
+	enum can_err_state can_err_state;
+	/* Time the bus went off and time of the last send attempt since. */
+	uint64_t bus_off_since_ns;
+	uint64_t bus_off_probe_ns;
+	struct can_error_stats can_err_stats;
+	/* NULL unless the tx_stamps option is set. */
+	struct tx_stamp_state *tx_stamps;
+	/* Set if in_sfd reports the arrival time of each packet. */
+	bool rx_stamps;
+	/* Number of scheduled frames dropped for missing their launch time. */
+	uint64_t txtime_missed;
+	/* Number of scheduled frames rejected for other reasons. */
+	uint64_t txtime_errors;
+	/* Number of cyclic frames sent and failed to send. */
+	uint64_t cyclic_sent;
+	uint64_t cyclic_failed;
+	/* Time spent in handlers of this connection, per call. */
+	struct histogram handler_time;
+	/* Library callbacks, NULL unless set, see udpcan.h. */
+	udpcan_frame_cb frame_cb;
+	void *frame_cb_arg;
+	udpcan_batch_cb batch_cb;
+	void *batch_cb_arg;
+	/*
+	 * Time the event loop first deferred events of can_sfd and in_sfd, 0
+	 * if not deferred. Indexed by enum loop_fd_kind.
+	 */
+	uint64_t deferred_since_ns[2];
+	/* Set once udpcan_start() has set up the connection. */
+	bool started;
+};
+
+/* Resolves a CAN interface name to an interface index. */
+static int resolve_can_ifindex(int sfd, const char *ifname)
+{
+	struct ifreq ifr;
+	if (strlen(ifname) >= sizeof(ifr.ifr_name)) {
+		failx("CAN interface name too long: '%s'",
+				ifname);
+	}
+	strcpy(ifr.ifr_name, ifname);
+	if (ioctl(sfd, SIOCGIFINDEX, &ifr) == -1) {
+		fail("Failed to resolve CAN interface name '%s'",
+				ifname);
+	}
+	return ifr.ifr_ifindex;
+}
+
+/* Binds a socket to a CAN interface and returns its fd. */
+static int bind_can(const char *ifname)
+{
+	int sfd;
+	if ((sfd = socket(PF_CAN, SOCK_RAW, CAN_RAW)) == -1)
+		fail("socket");
+	own_fd(sfd);
+	can_err_mask_t err_mask = CAN_ERR_TX_TIMEOUT | CAN_ERR_LOSTARB |
+			CAN_ERR_CRTL | CAN_ERR_PROT | CAN_ERR_ACK |
+			CAN_ERR_BUSOFF | CAN_ERR_BUSERROR | CAN_ERR_RESTARTED;
+	if (setsockopt(sfd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
+			&err_mask, sizeof(err_mask)) == -1)
+		fail("setsockopt(CAN_RAW_ERR_FILTER)");
+	struct sockaddr_can addr;
+	addr.can_family  = AF_CAN;
+	addr.can_ifindex = resolve_can_ifindex(sfd, ifname);
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fail("Failed to bind to CAN interface '%s'",
+				ifname);
+	}
+	return sfd;
+}
+
+/*
+ * Binds a J1939 socket to a CAN interface and returns its fd. The socket
+ * receives all J1939 messages seen on the bus. If addr is not J1939_NO_ADDR,
+ * it is used as the source address for sent messages.
+ */
+static int bind_j1939(const char *ifname, uint8_t src_addr)
+{
+	int sfd;
+	if ((sfd = socket(PF_CAN, SOCK_DGRAM, CAN_J1939)) == -1)
+		fail("socket");
+	own_fd(sfd);
+	int on = 1;
+	if (setsockopt(sfd, SOL_CAN_J1939, SO_J1939_PROMISC,
+			&on, sizeof(on)) == -1)
+		fail("setsockopt(SO_J1939_PROMISC)");
+	if (setsockopt(sfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) == -1)
+		fail("setsockopt(SO_BROADCAST)");
+	struct sockaddr_can addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family  = AF_CAN;
+	addr.can_ifindex = resolve_can_ifindex(sfd, ifname);
+	addr.can_addr.j1939.name = J1939_NO_NAME;
+	addr.can_addr.j1939.pgn = J1939_NO_PGN;
+	addr.can_addr.j1939.addr = src_addr;
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fail("Failed to bind to J1939 interface '%s'",
+				ifname);
+	}
+	return sfd;
+}
+
+/*
+ * Binds a socket to a UDP port on all IPv4 addresses, or all IPv6 addresses
+ * if IPv4 is unavailable, and returns its fd. The port must be numeric, so it
+ * is parsed here rather than by getaddrinfo(), which is costly with
+ * thousands of connections. ICMP errors caused by packets sent from the
+ * socket are queued on its error queue, see read_udp_errqueue(). The address
+ * family of the socket is stored in family.
+ */
+static int bind_udp(const char *port, sa_family_t *family)
+{
+	long long port_num = parse_uint(port, 65535);
+	if (port_num < 0)
+		failx("Invalid UDP port '%s'", port);
+	struct sockaddr_in in4 = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port_num),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	struct sockaddr_in6 in6 = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(port_num),
+		.sin6_addr = IN6ADDR_ANY_INIT,
+	};
+	const struct sockaddr *addrs[] = {
+		(struct sockaddr *)&in4,
+		(struct sockaddr *)&in6,
+	};
+	const socklen_t addrlens[] = { sizeof(in4), sizeof(in6) };
+	int sfd = -1;
+	int errcode = 0;
+	for (int i = 0; i < 2 && sfd == -1; i++) {
+		*family = addrs[i]->sa_family;
+		sfd = socket(*family, SOCK_DGRAM, 0);
+		if (sfd == -1 && errno == EAFNOSUPPORT) {
+			errcode = errno;
+			continue;
+		}
+		if (sfd == -1)
+			fail("socket");
+		if (bind(sfd, addrs[i], addrlens[i]) == -1) {
+			errcode = errno;
+			close(sfd);
+			sfd = -1;
+		}
+	}
+	if (sfd == -1) {
+		errno =  errcode;
+		fail("Failed to bind to UDP port '%s'", port);
+	}
+	own_fd(sfd);
+	int on = 1;
+	int rc = *family == AF_INET ?
+			setsockopt(sfd, SOL_IP, IP_RECVERR, &on, sizeof(on)) :
+			setsockopt(sfd, SOL_IPV6, IPV6_RECVERR, &on, sizeof(on));
+	if (rc == -1)
+		fail("setsockopt(IP_RECVERR)");
+	return sfd;
+}
+
+/*
+ * Connects a socket to the first usable address of a UDP destination resolved
+ * by resolve_destinations() and returns its fd. Prints an error and returns
+ * -1 on failure.
+ */
+static int connect_udp(const struct addrinfo *ai, const char *host,
+		const char *port)
+{
+	int errcode = 0;
+	int sfd = -1;
+	for (const struct addrinfo *rp = ai; rp != NULL; rp = rp->ai_next) {
+		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if (sfd == -1) {
+			warn("socket");
+			return -1;
+		}
+		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
+			break;
+		errcode = errno;
+		close(sfd);
+		sfd = -1;
+	}
+	if (sfd == -1) {
+		errno =  errcode;
+		warn("Failed to connect to UDP address '%s:%s'", host, port);
+		return -1;
+	}
+	own_fd(sfd);
+	return sfd;
+}
+
+/* Enables TX timestamps on a CAN socket. */
+static void enable_tx_stamps(int can_sfd)
+{
+	int flags = SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE |
+			SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+			SOF_TIMESTAMPING_OPT_TSONLY;
+	if (setsockopt(can_sfd, SOL_SOCKET, SO_TIMESTAMPING,
+			&flags, sizeof(flags)) == -1)
+		fail("setsockopt(SO_TIMESTAMPING)");
+}
+
+/* Enables arrival timestamps (CLOCK_REALTIME) on a UDP socket. */
+static void enable_rx_stamps(int in_sfd)
+{
+	int on = 1;
+	if (setsockopt(in_sfd, SOL_SOCKET, SO_TIMESTAMPNS,
+			&on, sizeof(on)) == -1)
+		fail("setsockopt(SO_TIMESTAMPNS)");
+}
+
+/*
+ * Enables scheduled transmission on a CAN socket. Launch times are given in
+ * CLOCK_TAI, which is what the ETF qdisc expects.
+ */
+static void enable_txtime(int can_sfd)
+{
+	struct sock_txtime txtime = {
+		.clockid = CLOCK_TAI,
+		.flags = SOF_TXTIME_REPORT_ERRORS,
+	};
+	if (setsockopt(can_sfd, SOL_SOCKET, SO_TXTIME,
+			&txtime, sizeof(txtime)) == -1)
+		fail("setsockopt(SO_TXTIME)");
+}
+
+/*
+ * Converts a CLOCK_REALTIME time to CLOCK_TAI. The offset between the two
+ * clocks only changes on leap seconds, but reading both clocks is cheap.
+ */
+static uint64_t realtime_to_tai_ns(uint64_t realtime_ns)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_TAI, &ts);
+	return timespec_ns(&ts) - (now_realtime_ns() - realtime_ns);
+}
+
+/*
+ * Records a frame sent to can_sfd so that its TX timestamp can be matched
+ * later. Must be called for each send attempt, because the kernel assigns
+ * a key even to frames it fails to transmit.
+ */
+static void tx_stamp_sent(struct connection *conn, uint64_t arrival_ns)
+{
+	struct tx_stamp_state *state = conn->tx_stamps;
+	uint32_t key = state->next_key++;
+	struct tx_stamp_entry *entry = &state->ring[key % TX_STAMP_RING_SIZE];
+	entry->key = key;
+	entry->send_ns = now_realtime_ns();
+	entry->arrival_ns = arrival_ns != 0 ? arrival_ns : entry->send_ns;
+	entry->sched_ns = 0;
+	histogram_add(&state->udpcan, entry->send_ns - entry->arrival_ns);
+}
+
+/*
+ * Reads the error queue of can_sfd. The queue is used for TX timestamps and
+ * for reporting scheduled frames dropped by the qdisc.
+ */
+static void read_can_errqueue(struct connection *conn)
+{
+	struct tx_stamp_state *state = conn->tx_stamps;
+	while (1) {
+		CMSG_BUFFER(control,
+				CMSG_SPACE(sizeof(struct scm_timestamping)) +
+				CMSG_SPACE(sizeof(struct sock_extended_err) +
+					   sizeof(struct sockaddr_can)));
+		struct msghdr mh = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		if (recvmsg(conn->can_sfd, &mh,
+				MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				printf("%s: CAN: failed to read error queue: "
+						"%s\n", str_config(&conn->config),
+						strerror(errno));
+			}
+			return;
+		}
+		const struct scm_timestamping *tss = NULL;
+		const struct sock_extended_err *serr = NULL;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+					cmsg->cmsg_type == SCM_TIMESTAMPING)
+				tss = (void *)CMSG_DATA(cmsg);
+			else if (cmsg->cmsg_level == SOL_CAN_RAW &&
+					cmsg->cmsg_type == SCM_CAN_RAW_ERRQUEUE)
+				serr = (void *)CMSG_DATA(cmsg);
+		}
+		if (serr && serr->ee_origin == SO_EE_ORIGIN_TXTIME) {
+			if (serr->ee_code == SO_EE_CODE_TXTIME_MISSED)
+				conn->txtime_missed++;
+			else
+				conn->txtime_errors++;
+			continue;
+		}
+		if (!state || !tss || !serr ||
+				serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+			continue;
+		struct tx_stamp_entry *entry =
+			&state->ring[serr->ee_data % TX_STAMP_RING_SIZE];
+		uint64_t ts = timespec_ns(&tss->ts[0]);
+		if (entry->key != serr->ee_data || ts == 0) {
+			state->unmatched++;
+			continue;
+		}
+		switch (serr->ee_info) {
+		case SCM_TSTAMP_SCHED:
+			entry->sched_ns = ts;
+			break;
+		case SCM_TSTAMP_SND:
+			histogram_add(&state->total, ts - entry->arrival_ns);
+			if (entry->sched_ns != 0) {
+				histogram_add(&state->qdisc,
+						ts - entry->sched_ns);
+			}
+			break;
+		}
+	}
+}
+
+/* Returns the can_prio class of a CAN id, -1 if none matches. */
+static int can_prio_classify(const struct config *config, canid_t can_id)
+{
+	uint32_t id = can_id & CAN_EFF_MASK;
+	for (int i = 0; i < config->n_can_prio; i++) {
+		if (id >= config->can_prio[i].ids.first &&
+				id <= config->can_prio[i].ids.last)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Called when a send failed with EINVAL. Kernels before SO_PRIORITY was
+ * accepted as a control message reject frames that carry it: returns true if
+ * the send is worth retrying without it.
+ */
+static bool can_prio_reject_priority(struct connection *conn)
+{
+	if (conn->can_prio->no_priority)
+		return false;
+	printf("%s: SO_PRIORITY not supported per frame, sending CAN frames "
+			"without priority\n", str_config(&conn->config));
+	conn->can_prio->no_priority = true;
+	return true;
+}
+
+/*
+ * Sends a CAN frame to can_sfd with control messages: its launch time if the
+ * txtime option is set, and priority unless it is -1.
+ */
+static int send_can_frame_msg(struct connection *conn,
+		const struct can_frame *frame, uint64_t arrival_ns,
+		int priority)
+{
+	CMSG_BUFFER(control, CMSG_SPACE(sizeof(uint64_t)) +
+			CMSG_SPACE(sizeof(uint32_t)));
+	struct iovec iov = {
+		.iov_base = (void *)frame,
+		.iov_len = sizeof(*frame),
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	size_t len = 0;
+	if (conn->config.txtime) {
+		if (arrival_ns == 0)
+			arrival_ns = now_realtime_ns();
+		uint64_t txtime = realtime_to_tai_ns(arrival_ns) +
+				(uint64_t)conn->config.txtime_offset_us * 1000;
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+		memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+		len += CMSG_SPACE(sizeof(txtime));
+		cmsg = CMSG_NXTHDR(&mh, cmsg);
+	}
+	if (priority >= 0) {
+		uint32_t value = priority;
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SO_PRIORITY;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(value));
+		memcpy(CMSG_DATA(cmsg), &value, sizeof(value));
+		len += CMSG_SPACE(sizeof(value));
+	}
+	mh.msg_controllen = len;
+	if (len == 0)
+		mh.msg_control = NULL;
+	return sendmsg(conn->can_sfd, &mh, 0);
+}
+
+/*
+ * Sends a CAN frame to can_sfd, with the priority of its can_prio class if
+ * any. arrival_ns is the time the frame arrived to in_sfd (CLOCK_REALTIME) or
+ * 0 if unknown.
+ */
+static int send_can_frame(struct connection *conn,
+		const struct can_frame *frame, uint64_t arrival_ns)
+{
+	PROBE4(can_send, conn->id, frame->can_id, frame->can_dlc, arrival_ns);
+	if (conn->tx_stamps)
+		tx_stamp_sent(conn, arrival_ns);
+	int class = conn->can_prio ?
+			can_prio_classify(&conn->config, frame->can_id) : -1;
+	int priority = class >= 0 && !conn->can_prio->no_priority ?
+			conn->config.can_prio[class].priority : -1;
+	int rc;
+	if (!conn->config.txtime && priority < 0)
+		rc = send(conn->can_sfd, frame, sizeof(*frame), 0);
+	else
+		rc = send_can_frame_msg(conn, frame, arrival_ns, priority);
+	if (rc == -1 && errno == EINVAL && priority >= 0 &&
+			can_prio_reject_priority(conn))
+		rc = send_can_frame_msg(conn, frame, arrival_ns, -1);
+	if (rc != -1 && class >= 0)
+		conn->can_prio->sent[class]++;
+	return rc;
+}
+
+/* Marks the CAN controller as recovered from the bus-off state. */
+static void bus_off_recovered(struct connection *conn)
+{
+	struct can_error_stats *stats = &conn->can_err_stats;
+	uint64_t duration = now_ns() - conn->bus_off_since_ns;
+	conn->bus_off = false;
+	stats->recoveries++;
+	stats->bus_off_total_ns += duration;
+	if (duration > stats->bus_off_max_ns)
+		stats->bus_off_max_ns = duration;
+	printf("%s: CAN: recovered from bus-off after %llu ms, "
+			"%llu frames dropped so far\n",
+			str_config(&conn->config),
+			(unsigned long long)(duration / 1000000),
+			(unsigned long long)stats->dropped_bus_off);
+}
+
+/*
+ * Logs a change of the error state of the CAN controller. Error frames can
+ * arrive thousands of times per second on a noisy bus, so only the changes
+ * are logged and the rest is left to the error statistics.
+ */
+static void can_err_state_set(struct connection *conn,
+		enum can_err_state state)
+{
+	if (state == conn->can_err_state)
+		return;
+	conn->can_err_state = state;
+	printf("%s: CAN: %s\n", str_config(&conn->config),
+			can_err_state_names[state]);
+}
+
+/*
+ * Classifies a CAN error frame, updates error statistics and the error and
+ * bus-off state of the connection. Returns a human-readable error class.
+ */
+static const char *handle_can_error(struct connection *conn,
+		const struct can_frame *frame)
+{
+	struct can_error_stats *stats = &conn->can_err_stats;
+	canid_t err_class = frame->can_id & CAN_ERR_MASK;
+	const char *desc = "bus error";
+	if (err_class & (CAN_ERR_PROT | CAN_ERR_ACK | CAN_ERR_BUSERROR))
+		stats->bus_error++;
+	if (err_class & CAN_ERR_LOSTARB) {
+		stats->arbitration_lost++;
+		desc = "arbitration lost";
+	}
+	if (err_class & CAN_ERR_TX_TIMEOUT) {
+		stats->tx_timeout++;
+		desc = "TX timeout";
+	}
+	if (err_class & CAN_ERR_CRTL) {
+		uint8_t ctrl = frame->data[1];
+		if (ctrl & (CAN_ERR_CRTL_RX_OVERFLOW |
+				CAN_ERR_CRTL_TX_OVERFLOW)) {
+			stats->overflow++;
+			desc = "controller overflow";
+		}
+		if (ctrl & (CAN_ERR_CRTL_RX_WARNING |
+				CAN_ERR_CRTL_TX_WARNING)) {
+			stats->error_warning++;
+			desc = "error warning";
+			can_err_state_set(conn, CAN_ERR_STATE_WARNING);
+		}
+		if (ctrl & (CAN_ERR_CRTL_RX_PASSIVE |
+				CAN_ERR_CRTL_TX_PASSIVE)) {
+			stats->error_passive++;
+			desc = "error passive";
+			can_err_state_set(conn, CAN_ERR_STATE_PASSIVE);
+		}
+		if (ctrl & CAN_ERR_CRTL_ACTIVE) {
+			desc = "error active";
+			can_err_state_set(conn, CAN_ERR_STATE_ACTIVE);
+			if (conn->bus_off)
+				bus_off_recovered(conn);
+		}
+	}
+	if (err_class & CAN_ERR_RESTARTED) {
+		stats->restarted++;
+		desc = "restarted";
+		can_err_state_set(conn, CAN_ERR_STATE_ACTIVE);
+		if (conn->bus_off)
+			bus_off_recovered(conn);
+	}
+	if (err_class & CAN_ERR_BUSOFF) {
+		stats->bus_off++;
+		desc = "bus-off";
+		if (!conn->bus_off) {
+			conn->bus_off = true;
+			conn->bus_off_since_ns = now_ns();
+			conn->bus_off_probe_ns = conn->bus_off_since_ns;
+			printf("%s: CAN: bus-off, pausing UDP->CAN\n",
+					str_config(&conn->config));
+		}
+	}
+	return desc;
+}
+
+static void peer_down(struct destination *dest, bool timed_out)
+{
+	struct peer_state *peer = &dest->peer;
+	if (peer->dead)
+		return;
+	peer->dead = true;
+	peer->timed_out = timed_out;
+	peer->probe_pending = false;
+	peer->dead_since_ns = now_ns();
+	peer->last_probe_ns = peer->dead_since_ns;
+	peer->deaths++;
+	printf("%s: peer %s:%s %s\n", str_config(&dest->conn->config),
+			dest->host, dest->port,
+			timed_out ? "timed out" : "unreachable");
+}
+
+static void peer_up(struct destination *dest)
+{
+	struct peer_state *peer = &dest->peer;
+	uint64_t duration = now_ns() - peer->dead_since_ns;
+	peer->dead = false;
+	peer->dead_total_ns += duration;
+	printf("%s: peer %s:%s alive after %llu ms, %llu packets suppressed "
+			"so far\n", str_config(&dest->conn->config),
+			dest->host, dest->port,
+			(unsigned long long)(duration / 1000000),
+			(unsigned long long)dest->conn->suppressed);
+}
+
+/*
+ * Converts an IPv4 or IPv6 socket address to an IPv6 address, mapping IPv4
+ * addresses. Returns false for other address families.
+ */
+static bool sockaddr_to_in6(const struct sockaddr *sa, struct in6_addr *addr)
+{
+	switch (sa->sa_family) {
+	case AF_INET:
+		memset(addr, 0, sizeof(*addr));
+		addr->s6_addr[10] = 0xff;
+		addr->s6_addr[11] = 0xff;
+		memcpy(&addr->s6_addr[12],
+				&((const struct sockaddr_in *)sa)->sin_addr, 4);
+		return true;
+	case AF_INET6:
+		*addr = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Returns true if two socket addresses have the same IP address. */
+static bool sockaddr_same_host(const struct sockaddr *a,
+		const struct sockaddr *b)
+{
+	struct in6_addr addr_a, addr_b;
+	return sockaddr_to_in6(a, &addr_a) && sockaddr_to_in6(b, &addr_b) &&
+		memcmp(&addr_a, &addr_b, sizeof(addr_a)) == 0;
+}
+
+/* Returns true if two IPv4 or IPv6 socket addresses are the same. */
+static bool sockaddr_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (!sockaddr_same_host(a, b))
+		return false;
+	in_port_t port_a = a->sa_family == AF_INET ?
+			((const struct sockaddr_in *)a)->sin_port :
+			((const struct sockaddr_in6 *)a)->sin6_port;
+	in_port_t port_b = b->sa_family == AF_INET ?
+			((const struct sockaddr_in *)b)->sin_port :
+			((const struct sockaddr_in6 *)b)->sin6_port;
+	return port_a == port_b;
+}
+
+static uint32_t hash_in6(const struct in6_addr *addr, int len)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	for (int i = 0; i < 16; i++)
+		hash = (hash ^ addr->s6_addr[i]) * 16777619U;
+	return (hash ^ len) * 16777619U;
+}
+
+/* Interval between checks for expired learned peers. */
+#define PEER_EXPIRE_INTERVAL_NS 1000000000ULL
+
+/* Forgets a learned peer. */
+static void forget_peer(struct connection *conn, struct destination *dest)
+{
+	printf("%s: forgetting peer %s:%s\n", str_config(&conn->config),
+			dest->host, dest->port);
+	/* Keep the array dense, which is what select_destination() expects. */
+	*dest = conn->dests[--conn->n_dests];
+	dest->host = dest->learned_host;
+	dest->port = dest->learned_port;
+}
+
+/* Forgets learned peers that have been silent for longer than peer_ttl. */
+static void expire_peers(struct connection *conn)
+{
+	uint64_t now = now_ns();
+	if (now - conn->peers_expired_ns < PEER_EXPIRE_INTERVAL_NS)
+		return;
+	conn->peers_expired_ns = now;
+	uint64_t ttl = conn->config.peer_ttl_s * 1000000000ULL;
+	for (int i = conn->n_dests - 1; i >= 0; i--) {
+		if (now - conn->dests[i].last_seen_ns > ttl)
+			forget_peer(conn, &conn->dests[i]);
+	}
+}
+
+/*
+ * Remembers the source of a packet received on in_sfd as a destination for
+ * CAN frames. If the peer table is full, the least recently seen peer is
+ * replaced.
+ */
+static void learn_peer(struct connection *conn, const struct sockaddr *src,
+		socklen_t src_len)
+{
+	uint64_t now = now_ns();
+	struct destination *oldest = NULL;
+	for (int i = 0; i < conn->n_dests; i++) {
+		struct destination *d = &conn->dests[i];
+		if (d->addrlen == src_len &&
+				memcmp(&d->addr, src, src_len) == 0) {
+			d->last_seen_ns = now;
+			return;
+		}
+		if (!oldest || d->last_seen_ns < oldest->last_seen_ns)
+			oldest = d;
+	}
+	if ((uint32_t)conn->n_dests == conn->config.max_peers)
+		forget_peer(conn, oldest);
+	struct destination *dest = &conn->dests[conn->n_dests++];
+	memset(dest, 0, sizeof(*dest));
+	if (getnameinfo(src, src_len, dest->learned_host,
+			sizeof(dest->learned_host), dest->learned_port,
+			sizeof(dest->learned_port),
+			NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+		strcpy(dest->learned_host, "?");
+		strcpy(dest->learned_port, "?");
+	}
+	dest->conn = conn;
+	dest->host = dest->learned_host;
+	dest->port = dest->learned_port;
+	dest->sfd = conn->in_sfd;
+	memcpy(&dest->addr, src, src_len);
+	dest->addrlen = src_len;
+	dest->learned = true;
+	dest->last_seen_ns = now;
+	printf("%s: learned peer %s:%s\n", str_config(&conn->config),
+			dest->host, dest->port);
+}
+
+/*
+ * Must be called whenever a packet is received on in_sfd. src is the source
+ * address of the packet. If peers are learned, the source is remembered.
+ * Otherwise, the packet is attributed to the destination with the same address,
+ * which is where a peer running udpcan sends from, else to the first one with
+ * the same host, or to the only destination if there is just one.
+ */
+static void peer_seen(struct connection *conn, const struct sockaddr *src,
+		socklen_t src_len)
+{
+	if (conn->config.learn_peers) {
+		learn_peer(conn, src, src_len);
+		return;
+	}
+	struct destination *dest = NULL;
+	if (conn->n_dests == 1) {
+		dest = &conn->dests[0];
+	} else {
+		for (int i = 0; i < conn->n_dests; i++) {
+			const struct sockaddr *addr =
+					(struct sockaddr *)&conn->dests[i].addr;
+			if (sockaddr_equal(src, addr)) {
+				dest = &conn->dests[i];
+				break;
+			}
+			if (!dest && sockaddr_same_host(src, addr))
+				dest = &conn->dests[i];
+		}
+		if (!dest)
+			return;
+	}
+	if (conn->config.heartbeat_ms != 0)
+		dest->peer.last_rx_ns = now_ns();
+	if (dest->peer.dead)
+		peer_up(dest);
+}
+
+/* Returns true if packets to a destination are sent from in_sfd. */
+static bool shares_in_sfd(const struct destination *dest)
+{
+	return dest->sfd == dest->conn->in_sfd;
+}
+
+/*
+ * Reads the ICMP errors queued on in_sfd by packets sent from it. Configured
+ * destinations that refused a packet are declared dead, as a connected socket
+ * would have reported with ECONNREFUSED. Returns the number of errors read.
+ */
+static int read_udp_errqueue(struct connection *conn)
+{
+	int n = 0;
+	while (1) {
+		struct sockaddr_storage offender;
+		CMSG_BUFFER(control,
+				CMSG_SPACE(sizeof(struct sock_extended_err) +
+					   sizeof(struct sockaddr_in6)));
+		struct msghdr mh = {
+			.msg_name = &offender,
+			.msg_namelen = sizeof(offender),
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		if (recvmsg(conn->in_sfd, &mh,
+				MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				printf("%s: UDP: failed to read error queue: "
+						"%s\n", str_config(&conn->config),
+						strerror(errno));
+			}
+			return n;
+		}
+		n++;
+		const struct sock_extended_err *serr = NULL;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if ((cmsg->cmsg_level == SOL_IP &&
+					cmsg->cmsg_type == IP_RECVERR) ||
+					(cmsg->cmsg_level == SOL_IPV6 &&
+					cmsg->cmsg_type == IPV6_RECVERR))
+				serr = (void *)CMSG_DATA(cmsg);
+		}
+		if (!serr || serr->ee_errno != ECONNREFUSED)
+			continue;
+		for (int i = 0; i < conn->n_dests; i++) {
+			struct destination *dest = &conn->dests[i];
+			if (dest->learned || !shares_in_sfd(dest) ||
+					!sockaddr_equal((struct sockaddr *)
+					&offender, (struct sockaddr *)
+					&dest->addr))
+				continue;
+			dest->peer.refused = true;
+			peer_down(dest, false);
+		}
+	}
+}
+
+/*
+ * Sends an empty datagram to a destination. Empty datagrams are used for both
+ * heartbeats and probes; receivers ignore them. In the authenticated mode,
+ * the datagram carries no frames but is still sealed so that it can't be
+ * forged to keep a dead peer alive. Returns -1 if the peer refused the
+ * datagram or an earlier one.
+ */
+static int peer_ping(struct destination *dest)
+{
+	struct auth_state *auth = dest->conn->auth;
+	const void *buf = "";
+	size_t size = 0;
+	if (auth) {
+		size = auth_seal(auth, NULL, 0);
+		buf = auth->tx_buf;
+	}
+	if (!shares_in_sfd(dest)) {
+		if (send(dest->sfd, buf, size, 0) == -1 &&
+				errno == ECONNREFUSED)
+			return -1;
+		return 0;
+	}
+	/*
+	 * A refusal reported by in_sfd may concern any destination sending
+	 * from it, the error queue tells which. If it was another one, the
+	 * datagram is sent again.
+	 */
+	dest->peer.refused = false;
+	if (sendto(dest->sfd, buf, size, 0, (struct sockaddr *)&dest->addr,
+			dest->addrlen) == -1 && errno == ECONNREFUSED &&
+			read_udp_errqueue(dest->conn) > 0 &&
+			!dest->peer.refused) {
+		sendto(dest->sfd, buf, size, 0, (struct sockaddr *)&dest->addr,
+				dest->addrlen);
+	}
+	return dest->peer.refused ? -1 : 0;
+}
+
+/*
+ * Checks whether a dead peer has come back. A peer that refused packets is
+ * probed with an empty datagram: if the probe isn't refused within the probe
+ * interval, the peer is considered alive. This costs one syscall per probe
+ * interval rather than a failed send per frame.
+ */
+static void peer_probe(struct destination *dest)
+{
+	struct peer_state *peer = &dest->peer;
+	uint32_t heartbeat_ms = dest->conn->config.heartbeat_ms;
+	uint64_t interval = heartbeat_ms != 0 ? heartbeat_ms * 1000000ULL :
+			PEER_PROBE_INTERVAL_NS;
+	uint64_t now = now_ns();
+	if (now - peer->last_probe_ns < interval)
+		return;
+	peer->last_probe_ns = now;
+	if (peer->probe_pending && !peer->timed_out) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (shares_in_sfd(dest))
+			error = peer->refused;
+		else if (getsockopt(dest->sfd, SOL_SOCKET, SO_ERROR,
+				&error, &len) == -1)
+			error = errno;
+		if (error == 0) {
+			peer->probe_pending = false;
+			peer_up(dest);
+			return;
+		}
+	}
+	peer->probes_sent++;
+	peer->probe_pending = peer_ping(dest) == 0;
+}
+
+/* Sends heartbeats and detects peer timeouts. */
+static void fire_heartbeat_timer(struct timer_wheel *wheel,
+		struct wheel_timer *timer)
+{
+	(void)wheel;
+	struct destination *dest = container_of(timer, struct destination,
+			peer.heartbeat_timer);
+	struct peer_state *peer = &dest->peer;
+	if (peer->dead) {
+		peer_probe(dest);
+		return;
+	}
+	peer->heartbeats_sent++;
+	if (peer_ping(dest) == -1) {
+		peer_down(dest, false);
+		return;
+	}
+	uint64_t timeout = PEER_TIMEOUT_HEARTBEATS *
+			dest->conn->config.heartbeat_ms * 1000000ULL;
+	if (now_ns() - peer->last_rx_ns > timeout)
+		peer_down(dest, true);
+}
+
+/* Starts sending heartbeats to each destination if enabled. */
+static void setup_heartbeat_timers(struct timer_wheel *wheel,
+		struct connection *conn)
+{
+	uint32_t interval = conn->config.heartbeat_ms;
+	if (interval == 0)
+		return;
+	for (int i = 0; i < conn->n_dests; i++) {
+		struct peer_state *peer = &conn->dests[i].peer;
+		peer->last_rx_ns = now_ns();
+		peer->heartbeat_timer.fire = fire_heartbeat_timer;
+		timer_wheel_add(wheel, &peer->heartbeat_timer,
+				interval, interval);
+	}
+}
+
+/* Returns true if a destination is usable, probing it if it's dead. */
+static bool destination_alive(struct destination *dest)
+{
+	if (dest->peer.dead)
+		peer_probe(dest);
+	return !dest->peer.dead;
+}
+
+/*
+ * Selects the destination for a packet according to the connection policy.
+ * Returns NULL if all destinations are dead. Learned peers are not expired
+ * here: forgetting one moves another within conn->dests, which would change
+ * destinations the caller already selected. See select_destinations().
+ */
+static struct destination *select_destination(struct connection *conn,
+		uint32_t key)
+{
+	int n = conn->n_dests;
+	if (n == 0)
+		return NULL;
+	int first = 0;
+	if (conn->config.learn_peers &&
+			conn->config.dest_policy == DEST_POLICY_FAILOVER) {
+		/* Reply to the peer we heard from most recently. */
+		for (int i = 1; i < n; i++) {
+			if (conn->dests[i].last_seen_ns >
+					conn->dests[first].last_seen_ns)
+				first = i;
+		}
+		return &conn->dests[first];
+	}
+	if (conn->config.dest_policy == DEST_POLICY_HASH && n > 1) {
+		/*
+		 * Partition by a hash of the key so that packets with the same
+		 * key always take the same path and stay ordered. Packets of
+		 * a dead destination are spread over the next ones.
+		 */
+		uint32_t hash = key * 2654435761U;
+		first = ((uint64_t)hash * n) >> 32;
+	}
+	for (int i = 0; i < n; i++) {
+		struct destination *dest = &conn->dests[(first + i) % n];
+		if (destination_alive(dest))
+			return dest;
+	}
+	return NULL;
+}
+
+/*
+ * Selects the destinations of a batch of up to MAX_BATCH packets, each one
+ * once, after expiring learned peers.
+ */
+static void select_destinations(struct connection *conn, const uint32_t *keys,
+		int n, struct destination **dests)
+{
+	if (conn->config.learn_peers)
+		expire_peers(conn);
+	for (int i = 0; i < n; i++)
+		dests[i] = select_destination(conn, keys[i]);
+}
+
+/* Selects new destinations for packets of a batch whose destination died. */
+static void fail_over_destinations(struct connection *conn,
+		const uint32_t *keys, int n, struct destination **dests)
+{
+	for (int i = 0; i < n; i++) {
+		if (dests[i] && dests[i]->peer.dead)
+			dests[i] = select_destination(conn, keys[i]);
+	}
+}
+
+/*
+ * Fills a message with a datagram passed to a UDP->CAN handler. The arrival
+ * timestamp, if requested, is the current time.
+ */
+static ssize_t replay_udp(const struct udp_datagram *dgram, struct msghdr *mh)
+{
+	size_t len = dgram->len;
+	if (mh->msg_iovlen == 0)
+		len = 0;
+	else if (len > mh->msg_iov[0].iov_len)
+		len = mh->msg_iov[0].iov_len;
+	if (len > 0)
+		memcpy(mh->msg_iov[0].iov_base, dgram->data, len);
+	if (mh->msg_name) {
+		socklen_t src_len = dgram->src_len < mh->msg_namelen ?
+				dgram->src_len : mh->msg_namelen;
+		memcpy(mh->msg_name, dgram->src, src_len);
+		mh->msg_namelen = dgram->src_len;
+	}
+	if (mh->msg_control) {
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(mh);
+		if (cmsg) {
+			uint64_t now = now_realtime_ns();
+			struct timespec ts = {
+				.tv_sec = now / 1000000000,
+				.tv_nsec = now % 1000000000,
+			};
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_TIMESTAMPNS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(ts));
+			memcpy(CMSG_DATA(cmsg), &ts, sizeof(ts));
+			mh->msg_controllen = CMSG_SPACE(sizeof(ts));
+		}
+	}
+	return dgram->size;
+}
+
+/*
+ * Receives a datagram from in_sfd. A refused packet sent from in_sfd fails the
+ * next receive, in which case the error queue is read and the receive retried.
+ */
+static ssize_t recv_in(struct connection *conn, struct msghdr *mh, int flags)
+{
+	ssize_t size = recvmsg(conn->in_sfd, mh, flags);
+	if (size == -1 && errno == ECONNREFUSED && read_udp_errqueue(conn) > 0)
+		size = recvmsg(conn->in_sfd, mh, flags);
+	return size;
+}
+
+/*
+ * Receives a datagram from in_sfd, or the datagram passed to the handler by
+ * deliver_udp().
+ */
+static ssize_t recv_udp(struct connection *conn, struct msghdr *mh, int flags)
+{
+	if (conn->rx_datagram)
+		return replay_udp(conn->rx_datagram, mh);
+	return recv_in(conn, mh, flags);
+}
+
+/*
+ * Calls a UDP->CAN handler with a datagram that did not come from in_sfd:
+ * one released by the impairment stage or received with AF_XDP.
+ */
+static void deliver_udp(struct connection *conn,
+		const struct udp_datagram *dgram,
+		void (*handler)(struct connection *conn))
+{
+	conn->rx_datagram = dgram;
+	handler(conn);
+	conn->rx_datagram = NULL;
+}
+
+/*
+ * AF_XDP fast path. An XDP program on the interface of the xdp option
+ * redirects UDP packets to IN_PORT of the connections using the interface to
+ * an AF_XDP socket, bypassing the kernel network stack. Ethernet, IP and UDP
+ * headers are parsed and built here. Packets that the program passes, such as
+ * fragments or packets arriving on queues without a socket, still reach
+ * in_sfd.
+ */
+
+/* Number of UMEM frames per socket, half for RX and half for TX. */
+#define XDP_FRAMES 4096
+#define XDP_FRAME_SIZE 2048
+/* Number of descriptors of each ring. */
+#define XDP_RING_SIZE (XDP_FRAMES / 2)
+/* Max number of packets processed per call of xdp_receive(). */
+#define XDP_RX_BATCH 64
+/* Number of packets queued for TX after which the kernel is kicked. */
+#define XDP_TX_BATCH 64
+/* Number of next hops remembered per socket. */
+#define XDP_NEIGHBORS 256
+/* Max queue index of the xdp option plus one. */
+#define XDP_MAX_QUEUES 64
+
+#define XDP_ETH_HDR_SIZE 14
+#define XDP_IPV4_HDR_SIZE 20
+#define XDP_IPV6_HDR_SIZE 40
+#define XDP_UDP_HDR_SIZE 8
+
+/* Single-producer single-consumer ring shared with the kernel. */
+struct xdp_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *descs;
+};
+
+/*
+ * Link-layer address of a peer, learned from packets received from it. Peers
+ * are sent to with AF_XDP only once their address is known.
+ */
+struct xdp_neighbor {
+	bool valid;
+	/* IP address of the peer, IPv4 addresses are mapped. */
+	struct in6_addr addr;
+	/* Address the peer sent to, used as the source address. */
+	struct in6_addr local;
+	/* Source MAC address of packets from the peer, maybe a router. */
+	uint8_t mac[ETH_ALEN];
+};
+
+/* Connection whose IN_PORT packets are redirected to AF_XDP sockets. */
+struct xdp_binding {
+	struct connection *conn;
+	/* Family of in_sfd, used for the source addresses of datagrams. */
+	sa_family_t family;
+};
+
+/* Network interface with the XDP program attached. */
+struct xdp_iface {
+	char *ifname;
+	int ifindex;
+	enum xdp_mode mode;
+	uint8_t mac[ETH_ALEN];
+	uint32_t mtu;
+	/* XSKMAP the program redirects to, indexed by RX queue. */
+	int map_fd;
+	struct xdp_binding *bindings;
+	int n_bindings;
+};
+
+/* AF_XDP socket bound to a queue of an interface. */
+struct xdp_socket {
+	struct xdp_iface *iface;
+	uint32_t queue;
+	int fd;
+	uint8_t *umem;
+	struct xdp_ring fill, completion, rx, tx;
+	/* UMEM frames available for TX. */
+	uint64_t free_frames[XDP_FRAMES / 2];
+	int n_free;
+	/* Number of TX descriptors queued since the kernel was last kicked. */
+	int tx_pending;
+	/* IPv4 identification of the next packet. */
+	uint16_t ip_id;
+	struct xdp_neighbor neighbors[XDP_NEIGHBORS];
+	/* Statistics. */
+	uint64_t received, sent, malformed, unknown_port, via_kernel;
+};
+
+/* Headers of a UDP packet received with AF_XDP. */
+struct xdp_packet {
+	const uint8_t *src_mac;
+	/* Addresses, IPv4 addresses are mapped. */
+	struct in6_addr src, dst;
+	/* Ports in network byte order. */
+	uint16_t src_port, dst_port;
+	const uint8_t *payload;
+	size_t payload_size;
+};
+
+/* Adds data to an Internet checksum (RFC 1071). */
+static uint32_t csum_add(uint32_t sum, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	for (; size > 1; p += 2, size -= 2)
+		sum += p[0] << 8 | p[1];
+	if (size > 0)
+		sum += p[0] << 8;
+	return sum;
+}
+
+/* Returns the checksum of the data added to sum, in host byte order. */
+static uint16_t csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/* Sums the IPv4 or IPv6 pseudo-header of a UDP datagram. */
+static uint32_t udp_pseudo_csum(const struct in6_addr *src,
+		const struct in6_addr *dst, size_t udp_size)
+{
+	bool ipv4 = IN6_IS_ADDR_V4MAPPED(src);
+	uint32_t sum = IPPROTO_UDP + udp_size;
+	sum = csum_add(sum, &src->s6_addr[ipv4 ? 12 : 0], ipv4 ? 4 : 16);
+	return csum_add(sum, &dst->s6_addr[ipv4 ? 12 : 0], ipv4 ? 4 : 16);
+}
+
+/* Maps an IPv4 address in network byte order to an IPv6 address. */
+static void map_in4(const void *in4, struct in6_addr *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->s6_addr[10] = 0xff;
+	addr->s6_addr[11] = 0xff;
+	memcpy(&addr->s6_addr[12], in4, 4);
+}
+
+/*
+ * Parses an Ethernet frame that the XDP program redirected. Returns -1 unless
+ * it is a well-formed UDP datagram.
+ */
+static int xdp_parse(const uint8_t *frame, size_t size, struct xdp_packet *pkt)
+{
+	if (size < XDP_ETH_HDR_SIZE)
+		return -1;
+	const struct ether_header *eth = (const void *)frame;
+	const uint8_t *ip = frame + XDP_ETH_HDR_SIZE;
+	size -= XDP_ETH_HDR_SIZE;
+	const uint8_t *udp;
+	size_t udp_size;
+	switch (ntohs(eth->ether_type)) {
+	case ETH_P_IP: {
+		const struct iphdr *hdr = (const void *)ip;
+		if (size < XDP_IPV4_HDR_SIZE || hdr->version != 4)
+			return -1;
+		size_t hdr_size = hdr->ihl * 4;
+		size_t total = ntohs(hdr->tot_len);
+		if (hdr_size < XDP_IPV4_HDR_SIZE || total < hdr_size ||
+				total > size || hdr->protocol != IPPROTO_UDP ||
+				(ntohs(hdr->frag_off) & (IP_MF | IP_OFFMASK)) ||
+				csum_fold(csum_add(0, ip, hdr_size)) != 0)
+			return -1;
+		map_in4(ip + 12, &pkt->src);
+		map_in4(ip + 16, &pkt->dst);
+		udp = ip + hdr_size;
+		udp_size = total - hdr_size;
+		break;
+	}
+	case ETH_P_IPV6: {
+		const struct ip6_hdr *hdr = (const void *)ip;
+		if (size < XDP_IPV6_HDR_SIZE || hdr->ip6_nxt != IPPROTO_UDP)
+			return -1;
+		udp_size = ntohs(hdr->ip6_plen);
+		if (udp_size > size - XDP_IPV6_HDR_SIZE)
+			return -1;
+		memcpy(&pkt->src, &hdr->ip6_src, sizeof(pkt->src));
+		memcpy(&pkt->dst, &hdr->ip6_dst, sizeof(pkt->dst));
+		udp = ip + XDP_IPV6_HDR_SIZE;
+		break;
+	}
+	default:
+		return -1;
+	}
+	const struct udphdr *uh = (const void *)udp;
+	if (udp_size < XDP_UDP_HDR_SIZE || ntohs(uh->len) < XDP_UDP_HDR_SIZE ||
+			ntohs(uh->len) > udp_size)
+		return -1;
+	/*
+	 * The UDP checksum isn't verified: senders on the same host, such as
+	 * the other end of a veth pair, leave it to an offload that never
+	 * happens. The Ethernet FCS covers the frame on a real link.
+	 */
+	udp_size = ntohs(uh->len);
+	pkt->src_mac = eth->ether_shost;
+	pkt->src_port = uh->source;
+	pkt->dst_port = uh->dest;
+	pkt->payload = udp + XDP_UDP_HDR_SIZE;
+	pkt->payload_size = udp_size - XDP_UDP_HDR_SIZE;
+	return 0;
+}
+
+static struct xdp_neighbor *xdp_neighbor(struct xdp_socket *xsk,
+		const struct in6_addr *addr)
+{
+	return &xsk->neighbors[hash_in6(addr, 128) % XDP_NEIGHBORS];
+}
+
+/* Remembers the MAC address to reach the sender of a packet. */
+static void xdp_learn_neighbor(struct xdp_socket *xsk,
+		const struct xdp_packet *pkt)
+{
+	struct xdp_neighbor *n = xdp_neighbor(xsk, &pkt->src);
+	if (n->valid && memcmp(&n->addr, &pkt->src, sizeof(n->addr)) == 0 &&
+			memcmp(&n->local, &pkt->dst, sizeof(n->local)) == 0 &&
+			memcmp(n->mac, pkt->src_mac, ETH_ALEN) == 0)
+		return;
+	n->valid = true;
+	n->addr = pkt->src;
+	n->local = pkt->dst;
+	memcpy(n->mac, pkt->src_mac, ETH_ALEN);
+}
+
+/* Builds the socket address of the sender of a packet. */
+static socklen_t xdp_source(const struct xdp_packet *pkt, sa_family_t family,
+		struct sockaddr_storage *src)
+{
+	memset(src, 0, sizeof(*src));
+	if (family == AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&pkt->src)) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)src;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = pkt->src;
+		sin6->sin6_port = pkt->src_port;
+		return sizeof(*sin6);
+	}
+	struct sockaddr_in *sin = (struct sockaddr_in *)src;
+	sin->sin_family = AF_INET;
+	memcpy(&sin->sin_addr, &pkt->src.s6_addr[12], 4);
+	sin->sin_port = pkt->src_port;
+	return sizeof(*sin);
+}
+
+/* Passes a received packet to the connection listening on its port. */
+static void xdp_dispatch(struct xdp_socket *xsk, const uint8_t *frame,
+		size_t size)
+{
+	struct xdp_packet pkt;
+	if (xdp_parse(frame, size, &pkt) == -1) {
+		xsk->malformed++;
+		return;
+	}
+	const struct xdp_iface *iface = xsk->iface;
+	const struct xdp_binding *binding = NULL;
+	for (int i = 0; i < iface->n_bindings; i++) {
+		if (iface->bindings[i].conn->xdp_port == pkt.dst_port) {
+			binding = &iface->bindings[i];
+			break;
+		}
+	}
+	if (!binding) {
+		xsk->unknown_port++;
+		return;
+	}
+	xsk->received++;
+	xdp_learn_neighbor(xsk, &pkt);
+	struct sockaddr_storage src;
+	struct udp_datagram dgram = {
+		.data = pkt.payload,
+		.size = pkt.payload_size,
+		.len = pkt.payload_size,
+		.src = &src,
+		.src_len = xdp_source(&pkt, binding->family, &src),
+	};
+	struct connection *conn = binding->conn;
+	deliver_udp(conn, &dgram, conn->udp_to_can);
+}
+
+/*
+ * Handles packets in the RX ring of an AF_XDP socket and gives their frames
+ * back to the kernel.
+ */
+static void xdp_receive(struct xdp_socket *xsk)
+{
+	uint32_t cons = *xsk->rx.consumer;
+	uint32_t n = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - cons;
+	if (n > XDP_RX_BATCH)
+		n = XDP_RX_BATCH;
+	/*
+	 * Every RX frame is either in the fill ring, in the RX ring or being
+	 * handled, so the fill ring always has room for the handled ones.
+	 */
+	uint32_t fill_prod = *xsk->fill.producer;
+	const struct xdp_desc *descs = xsk->rx.descs;
+	uint64_t *fill = xsk->fill.descs;
+	for (uint32_t i = 0; i < n; i++) {
+		const struct xdp_desc *desc =
+				&descs[(cons + i) & (XDP_RING_SIZE - 1)];
+		xdp_dispatch(xsk, xsk->umem + desc->addr, desc->len);
+		fill[(fill_prod + i) & (XDP_RING_SIZE - 1)] =
+				desc->addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+	}
+	__atomic_store_n(xsk->rx.consumer, cons + n, __ATOMIC_RELEASE);
+	__atomic_store_n(xsk->fill.producer, fill_prod + n, __ATOMIC_RELEASE);
+}
+
+/* Takes back TX frames that the kernel is done with. */
+static void xdp_complete(struct xdp_socket *xsk)
+{
+	uint32_t cons = *xsk->completion.consumer;
+	uint32_t n = __atomic_load_n(xsk->completion.producer,
+			__ATOMIC_ACQUIRE) - cons;
+	const uint64_t *addrs = xsk->completion.descs;
+	for (uint32_t i = 0; i < n; i++) {
+		xsk->free_frames[xsk->n_free++] =
+				addrs[(cons + i) & (XDP_RING_SIZE - 1)];
+	}
+	__atomic_store_n(xsk->completion.consumer, cons + n, __ATOMIC_RELEASE);
+}
+
+/* Makes the kernel send the packets queued in the TX ring. */
+static void xdp_flush(struct xdp_socket *xsk)
+{
+	if (xsk->tx_pending == 0)
+		return;
+	xsk->tx_pending = 0;
+	if (__atomic_load_n(xsk->tx.flags, __ATOMIC_RELAXED) &
+			XDP_RING_NEED_WAKEUP)
+		sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+/*
+ * Sends a UDP packet to a destination with AF_XDP, with tos in the IPv4 TOS
+ * or IPv6 traffic class field. Returns -1 if the packet has to go through the
+ * kernel instead: the peer's MAC address isn't known yet, the packet would
+ * need fragmenting or the socket is out of frames.
+ */
+static int xdp_transmit(struct xdp_socket *xsk, struct destination *dest,
+		const void *buf, size_t size, uint8_t tos)
+{
+	struct in6_addr daddr;
+	if (!sockaddr_to_in6((struct sockaddr *)&dest->addr, &daddr))
+		return -1;
+	const struct xdp_neighbor *n = xdp_neighbor(xsk, &daddr);
+	bool ipv4 = IN6_IS_ADDR_V4MAPPED(&daddr);
+	size_t ip_size = (ipv4 ? XDP_IPV4_HDR_SIZE : XDP_IPV6_HDR_SIZE) +
+			XDP_UDP_HDR_SIZE + size;
+	if (!n->valid || memcmp(&n->addr, &daddr, sizeof(daddr)) != 0 ||
+			ip_size > xsk->iface->mtu ||
+			XDP_ETH_HDR_SIZE + ip_size > XDP_FRAME_SIZE)
+		goto via_kernel;
+	if (xsk->n_free == 0)
+		xdp_complete(xsk);
+	uint32_t prod = *xsk->tx.producer;
+	if (xsk->n_free == 0 || prod - __atomic_load_n(xsk->tx.consumer,
+			__ATOMIC_ACQUIRE) == XDP_RING_SIZE) {
+		xdp_flush(xsk);
+		goto via_kernel;
+	}
+	uint64_t addr = xsk->free_frames[--xsk->n_free];
+	uint8_t *frame = xsk->umem + addr;
+
+	struct ether_header *eth = (void *)frame;
+	memcpy(eth->ether_dhost, n->mac, ETH_ALEN);
+	memcpy(eth->ether_shost, xsk->iface->mac, ETH_ALEN);
+	eth->ether_type = htons(ipv4 ? ETH_P_IP : ETH_P_IPV6);
+	uint8_t *ip = frame + XDP_ETH_HDR_SIZE;
+	struct udphdr *uh;
+	if (ipv4) {
+		struct iphdr *hdr = (void *)ip;
+		memset(hdr, 0, XDP_IPV4_HDR_SIZE);
+		hdr->version = 4;
+		hdr->ihl = XDP_IPV4_HDR_SIZE / 4;
+		hdr->tos = tos;
+		hdr->tot_len = htons(ip_size);
+		hdr->id = htons(xsk->ip_id++);
+		hdr->frag_off = htons(IP_DF);
+		hdr->ttl = 64;
+		hdr->protocol = IPPROTO_UDP;
+		memcpy(ip + 12, &n->local.s6_addr[12], 4);
+		memcpy(ip + 16, &daddr.s6_addr[12], 4);
+		hdr->check = htons(csum_fold(csum_add(0, ip,
+				XDP_IPV4_HDR_SIZE)));
+		uh = (void *)(ip + XDP_IPV4_HDR_SIZE);
+	} else {
+		struct ip6_hdr *hdr = (void *)ip;
+		hdr->ip6_flow = htonl(6 << 28 | tos << 20);
+		hdr->ip6_plen = htons(ip_size - XDP_IPV6_HDR_SIZE);
+		hdr->ip6_nxt = IPPROTO_UDP;
+		hdr->ip6_hlim = 64;
+		memcpy(&hdr->ip6_src, &n->local, sizeof(n->local));
+		memcpy(&hdr->ip6_dst, &daddr, sizeof(daddr));
+		uh = (void *)(ip + XDP_IPV6_HDR_SIZE);
+	}
+	size_t udp_size = XDP_UDP_HDR_SIZE + size;
+	uh->source = dest->learned ? dest->conn->xdp_port : dest->src_port;
+	uh->dest = dest->addr.ss_family == AF_INET ?
+			((struct sockaddr_in *)&dest->addr)->sin_port :
+			((struct sockaddr_in6 *)&dest->addr)->sin6_port;
+	uh->len = htons(udp_size);
+	uh->check = 0;
+	memcpy(uh + 1, buf, size);
+	uint16_t check = csum_fold(csum_add(udp_pseudo_csum(&n->local, &daddr,
+			udp_size), uh, udp_size));
+	uh->check = htons(check != 0 ? check : 0xffff);
+
+	struct xdp_desc *desc = &((struct xdp_desc *)xsk->tx.descs)[
+			prod & (XDP_RING_SIZE - 1)];
+	desc->addr = addr;
+	desc->len = XDP_ETH_HDR_SIZE + ip_size;
+	desc->options = 0;
+	__atomic_store_n(xsk->tx.producer, prod + 1, __ATOMIC_RELEASE);
+	xsk->sent++;
+	if (++xsk->tx_pending == XDP_TX_BATCH)
+		xdp_flush(xsk);
+	return 0;
+via_kernel:
+	xsk->via_kernel++;
+	return -1;
+}
+
+/* Returns the qos class of a CAN id, -1 if it is in none. */
+static int qos_classify(const struct config *config, uint32_t can_id)
+{
+	uint32_t id = can_id & CAN_EFF_MASK;
+	for (int i = 0; i < config->n_qos; i++) {
+		if (id >= config->qos[i].ids.first &&
+				id <= config->qos[i].ids.last)
+			return i;
+	}
+	return -1;
+}
+
+/* Returns the TOS byte of packets carrying a CAN frame, for AF_XDP. */
+static uint8_t qos_tos(const struct connection *conn, uint32_t can_id)
+{
+	int class = conn->qos ? qos_classify(&conn->config, can_id) : -1;
+	return class < 0 ? 0 : conn->config.qos[class].dscp << 2;
+}
+
+static bool destination_ipv4(const struct destination *dest)
+{
+	return dest->addr.ss_family == AF_INET || IN6_IS_ADDR_V4MAPPED(
+			&((const struct sockaddr_in6 *)&dest->addr)->sin6_addr);
+}
+
+/* Builds the control messages of each qos class of a connection. */
+static void qos_build_controls(struct connection *conn)
+{
+	struct qos_state *qos = conn->qos;
+	for (int i = 0; i < conn->config.n_qos; i++) {
+		const struct qos_class *class = &conn->config.qos[i];
+		for (int ipv6 = 0; ipv6 < 2; ipv6++) {
+			struct msghdr mh = {
+				.msg_control = qos->control[i][ipv6],
+				.msg_controllen = QOS_CONTROL_SIZE,
+			};
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+			int tos = class->dscp << 2;
+			cmsg->cmsg_level = ipv6 ? IPPROTO_IPV6 : IPPROTO_IP;
+			cmsg->cmsg_type = ipv6 ? IPV6_TCLASS : IP_TOS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(tos));
+			memcpy(CMSG_DATA(cmsg), &tos, sizeof(tos));
+			size_t len = CMSG_SPACE(sizeof(tos));
+			if (class->priority >= 0 && !qos->no_priority) {
+				uint32_t priority = class->priority;
+				cmsg = CMSG_NXTHDR(&mh, cmsg);
+				cmsg->cmsg_level = SOL_SOCKET;
+				cmsg->cmsg_type = SO_PRIORITY;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(priority));
+				memcpy(CMSG_DATA(cmsg), &priority,
+						sizeof(priority));
+				len += CMSG_SPACE(sizeof(priority));
+			}
+			qos->controllen[i][ipv6] = len;
+		}
+	}
+}
+
+/*
+ * Attaches the marking of the qos class of a CAN id to a message to a
+ * destination, or clears it if the connection has no class for the id.
+ */
+static void qos_mark(struct connection *conn, const struct destination *dest,
+		uint32_t can_id, struct msghdr *mh)
+{
+	int class = conn->qos ? qos_classify(&conn->config, can_id) : -1;
+	if (class < 0) {
+		mh->msg_control = NULL;
+		mh->msg_controllen = 0;
+		return;
+	}
+	int ipv6 = !destination_ipv4(dest);
+	mh->msg_control = conn->qos->control[class][ipv6];
+	mh->msg_controllen = conn->qos->controllen[class][ipv6];
+}
+
+static void qos_count_sent(struct connection *conn, uint32_t can_id)
+{
+	int class = conn->qos ? qos_classify(&conn->config, can_id) : -1;
+	if (class >= 0)
+		conn->qos->sent[class]++;
+}
+
+/*
+ * Called when a send failed with EINVAL. Kernels before SO_PRIORITY was
+ * accepted as a control message reject packets that carry it: drops it from
+ * the marking and returns true if the send is worth retrying.
+ */
+static bool qos_reject_priority(struct connection *conn)
+{
+	struct qos_state *qos = conn->qos;
+	if (!qos || qos->no_priority)
+		return false;
+	bool any = false;
+	for (int i = 0; i < conn->config.n_qos; i++)
+		any |= conn->config.qos[i].priority >= 0;
+	if (!any)
+		return false;
+	printf("%s: SO_PRIORITY not supported per packet, marking DSCP only\n",
+			str_config(&conn->config));
+	qos->no_priority = true;
+	qos_build_controls(conn);
+	return true;
+}
+
+/*
+ * Sends UDP packets to OUT_HOST, bypassing the impairment stage. Each message
+ * holds one packet in a single iovec, keys[i] selects the destination of
+ * msgs[i]. Runs of packets that go to the same destination are sent with one
+ * sendmmsg(). Returns -1 if sending any packet failed, with errno set.
+ */
+static int transmit_udp_batch(struct connection *conn, const uint32_t *keys,
+		struct mmsghdr *msgs, int n)
+{
+	struct destination *dests[MAX_BATCH];
+	select_destinations(conn, keys, n, dests);
+	int rc = 0;
+	int i = 0;
+	while (i < n) {
+		const struct iovec *iov = msgs[i].msg_hdr.msg_iov;
+		struct destination *dest = dests[i];
+		if (!dest) {
+			PROBE3(drop, conn->id, keys[i], DROP_SUPPRESSED);
+			conn->suppressed++;
+			i++;
+			continue;
+		}
+		if (conn->xdp && xdp_transmit(conn->xdp, dest, iov->iov_base,
+				iov->iov_len, qos_tos(conn, keys[i])) == 0) {
+			PROBE4(udp_send, conn->id, keys[i], iov->iov_len,
+					iov->iov_len);
+			dest->sent++;
+			qos_count_sent(conn, keys[i]);
+			i++;
+			continue;
+		}
+		/* AF_XDP batches by itself, only the fallback goes here. */
+		int end = i + 1;
+		while (end < n && !conn->xdp && dests[end] == dest)
+			end++;
+		bool shared = shares_in_sfd(dest);
+		for (int j = i; j < end; j++) {
+			msgs[j].msg_hdr.msg_name = shared ? &dest->addr : NULL;
+			msgs[j].msg_hdr.msg_namelen =
+					shared ? dest->addrlen : 0;
+			qos_mark(conn, dest, keys[j], &msgs[j].msg_hdr);
+		}
+		int sent = sendmmsg(dest->sfd, &msgs[i], end - i, 0);
+		if (sent == -1 && errno == EINVAL && qos_reject_priority(conn))
+			continue;
+		if (sent == -1 && errno == ECONNREFUSED && !shared) {
+			/* Fail over to the next destination. */
+			peer_down(dest, false);
+			fail_over_destinations(conn, &keys[i], n - i,
+					&dests[i]);
+			continue;
+		}
+		/*
+		 * in_sfd reports refusals of packets to any destination, the
+		 * error queue tells which ones failed. Try again once they are
+		 * failed over from.
+		 */
+		if (sent == -1 && errno == ECONNREFUSED &&
+				read_udp_errqueue(conn) > 0) {
+			fail_over_destinations(conn, &keys[i], n - i,
+					&dests[i]);
+			continue;
+		}
+		if (sent == -1) {
+			PROBE4(udp_send, conn->id, keys[i], iov->iov_len, -1);
+			rc = -1;
+			i++;
+			continue;
+		}
+		/* The error of a partial send is reported by the next call. */
+		for (int j = i; j < i + sent; j++) {
+			PROBE4(udp_send, conn->id, keys[j],
+					msgs[j].msg_hdr.msg_iov->iov_len,
+					msgs[j].msg_len);
+			qos_count_sent(conn, keys[j]);
+		}
+		dest->sent += sent;
+		i += sent;
+	}
+	return rc;
+}
+
+/*
+ * Sends a UDP packet to OUT_HOST, bypassing the impairment stage. See
+ * send_udp().
+ */
+static int transmit_udp(struct connection *conn, uint32_t key,
+		const void *buf, size_t size)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = size,
+	};
+	struct mmsghdr msg = {
+		.msg_hdr = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+		},
+	};
+	return transmit_udp_batch(conn, &key, &msg, 1);
+}
+
+/* Returns a pseudo-random number (SplitMix64). */
+static uint64_t impair_random(struct impair_path *path)
+{
+	uint64_t z = (path->rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Returns true with a probability scaled to 2^32. */
+static bool impair_chance(struct impair_path *path, uint64_t probability)
+{
+	return probability != 0 && (impair_random(path) >> 32) < probability;
+}
+
+/* Returns a uniformly distributed number in [0, 1). */
+static double impair_uniform(struct impair_path *path)
+{
+	return (impair_random(path) >> 11) * 0x1.0p-53;
+}
+
+/* Draws the delay of a datagram from the configured distribution. */
+static uint64_t impair_delay_ns(struct impair_path *path)
+{
+	const struct impair_config *cfg = &path->imp->conn->config.impair;
+	double delay = cfg->delay_ms * 1e6;
+	double jitter = cfg->jitter_ms * 1e6;
+	if (jitter == 0) {
+		/* Nothing to draw. */
+	} else if (cfg->normal) {
+		/* Irwin-Hall approximation of the standard normal. */
+		double z = -6;
+		for (int i = 0; i < 12; i++)
+			z += impair_uniform(path);
+		delay += jitter * z;
+	} else {
+		delay += jitter * (2 * impair_uniform(path) - 1);
+	}
+	return delay > 0 ? delay : 0;
+}
+
+static struct impair_packet *impair_alloc(struct impair_path *path)
+{
+	struct impairment *imp = path->imp;
+	struct impair_packet *pkt = imp->free_packets;
+	if (!pkt) {
+		PROBE3(drop, imp->conn->id, -1, DROP_IMPAIR);
+		path->overflow++;
+		return NULL;
+	}
+	imp->free_packets = pkt->next_free;
+	pkt->path = path;
+	return pkt;
+}
+
+static void impair_free(struct impair_packet *pkt)
+{
+	struct impairment *imp = pkt->path->imp;
+	pkt->next_free = imp->free_packets;
+	imp->free_packets = pkt;
+}
+
+/* Passes a datagram on, as if it just came out of the network. */
+static void impair_release(struct impair_packet *pkt)
+{
+	struct impair_path *path = pkt->path;
+	struct impairment *imp = path->imp;
+	struct connection *conn = imp->conn;
+	path->passed++;
+	if (path->rx) {
+		struct udp_datagram dgram = {
+			.data = pkt->data,
+			.size = pkt->size,
+			.len = pkt->size < sizeof(pkt->data) ?
+					pkt->size : sizeof(pkt->data),
+			.src = &pkt->src,
+			.src_len = pkt->src_len,
+		};
+		deliver_udp(conn, &dgram, imp->udp_to_can);
+	} else if (transmit_udp(conn, pkt->key, pkt->data, pkt->size) == -1) {
+		printf("%s: UDP: send failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+	}
+	impair_free(pkt);
+}
+
+static void fire_impair_timer(struct timer_wheel *wheel,
+		struct wheel_timer *timer)
+{
+	(void)wheel;
+	impair_release(container_of(timer, struct impair_packet, timer));
+}
+
+/*
+ * Delays a datagram by the time it takes to send it at the capped rate plus
+ * the propagation delay. Reordered datagrams skip the propagation delay and
+ * thus overtake the datagrams ahead of them.
+ */
+static void impair_delay(struct impair_path *path, struct impair_packet *pkt)
+{
+	const struct impair_config *cfg = &path->imp->conn->config.impair;
+	uint64_t now = now_ns();
+	uint64_t release_ns = now;
+	if (cfg->rate_kbit != 0) {
+		if (path->busy_until_ns > release_ns)
+			release_ns = path->busy_until_ns;
+		release_ns += pkt->size * 8000000ULL / cfg->rate_kbit;
+		path->busy_until_ns = release_ns;
+	}
+	if (impair_chance(path, cfg->reorder))
+		path->reordered++;
+	else
+		release_ns += impair_delay_ns(path);
+	if (release_ns <= now) {
+		impair_release(pkt);
+		return;
+	}
+	PROBE3(queue, path->imp->conn->id, pkt->size, release_ns - now);
+	pkt->timer.fire = fire_impair_timer;
+	timer_wheel_add_at(path->imp->wheel, &pkt->timer, release_ns);
+}
+
+/* Drops, duplicates and delays a datagram. */
+static void impair_datagram(struct impair_path *path,
+		struct impair_packet *pkt)
+{
+	const struct impair_config *cfg = &path->imp->conn->config.impair;
+	if (impair_chance(path, cfg->loss)) {
+		PROBE3(drop, path->imp->conn->id, -1, DROP_IMPAIR);
+		path->lost++;
+		impair_free(pkt);
+		return;
+	}
+	struct impair_packet *dup = NULL;
+	if (impair_chance(path, cfg->dup) && (dup = impair_alloc(path))) {
+		path->duplicated++;
+		dup->key = pkt->key;
+		dup->size = pkt->size;
+		dup->src = pkt->src;
+		dup->src_len = pkt->src_len;
+		memcpy(dup->data, pkt->data, pkt->size < sizeof(pkt->data) ?
+				pkt->size : sizeof(pkt->data));
+	}
+	impair_delay(path, pkt);
+	if (dup)
+		impair_delay(path, dup);
+}
+
+/*
+ * Sends a UDP packet to OUT_HOST through the impairment stage. Failures to
+ * send are reported when the packet is released, so 0 is always returned.
+ */
+static int impair_send(struct connection *conn, uint32_t key,
+		const void *buf, size_t size)
+{
+	struct impair_packet *pkt = impair_alloc(&conn->impair->tx);
+	if (!pkt)
+		return 0;
+	assert(size <= sizeof(pkt->data));
+	pkt->key = key;
+	pkt->size = size;
+	memcpy(pkt->data, buf, size);
+	impair_datagram(&conn->impair->tx, pkt);
+	return 0;
+}
+
+/* Receives a datagram from in_sfd into the impairment stage. */
+static void impair_udp_to_can(struct connection *conn)
+{
+	struct impair_packet *pkt = impair_alloc(&conn->impair->rx);
+	if (!pkt) {
+		struct msghdr mh = { 0 };
+		recv_udp(conn, &mh, MSG_DONTWAIT);
+		return;
+	}
+	struct iovec iov = {
+		.iov_base = pkt->data,
+		.iov_len = sizeof(pkt->data),
+	};
+	struct msghdr mh = {
+		.msg_name = &pkt->src,
+		.msg_namelen = sizeof(pkt->src),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	ssize_t size = recv_udp(conn, &mh, MSG_DONTWAIT | MSG_TRUNC);
+	if (size == -1) {
+		printf("%s: UDP->CAN: recv failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+		impair_free(pkt);
+		return;
+	}
+	pkt->size = size;
+	pkt->src_len = mh.msg_namelen;
+	impair_datagram(&conn->impair->rx, pkt);
+}
+
+/*
+ * Sends a UDP packet to OUT_HOST. key is used to select a destination (CAN id
+ * or J1939 PGN). If all destinations are dead, the packet is suppressed and
+ * 0 is returned.
+ */
+static int send_udp(struct connection *conn, uint32_t key,
+		const void *buf, size_t size)
+{
+	if (conn->impair && conn->impair->tx_enabled)
+		return impair_send(conn, key, buf, size);
+	return transmit_udp(conn, key, buf, size);
+}
+
+/* Sends a batch of UDP packets to OUT_HOST, see transmit_udp_batch(). */
+static int send_udp_batch(struct connection *conn, const uint32_t *keys,
+		struct mmsghdr *msgs, int n)
+{
+	if (!conn->impair || !conn->impair->tx_enabled)
+		return transmit_udp_batch(conn, keys, msgs, n);
+	for (int i = 0; i < n; i++) {
+		const struct iovec *iov = msgs[i].msg_hdr.msg_iov;
+		impair_send(conn, keys[i], iov->iov_base, iov->iov_len);
+	}
+	return 0;
+}
+
+/* Number of sources for which allowlist counters are kept. */
+#define ALLOWLIST_SOURCES 1024
+/* Max number of prefixes compiled into a kernel socket filter. */
+#define ALLOWLIST_MAX_KERNEL_PREFIXES 32
+
+/* Compiled prefix entry of an allowlist hash table. */
+struct allowlist_entry {
+	/* Prefix address with host bits cleared. */
+	struct in6_addr addr;
+	/* Prefix length, -1 if the entry is unused. */
+	int len;
+};
+
+/* Per-source allowlist counters. */
+struct allowlist_source {
+	struct in6_addr addr;
+	bool used;
+	uint64_t accepted;
+	uint64_t dropped;
+};
+
+/*
+ * Source allowlist compiled for fast lookup. Prefixes are stored in a hash
+ * table keyed by masked address and length, so a lookup costs one hash probe
+ * per distinct prefix length rather than one comparison per prefix.
+ */
+struct allowlist {
+	/* Distinct prefix lengths, longest first. */
+	int lens[129];
+	int n_lens;
+	/* Open-addressing hash table, size is a power of 2. */
+	struct allowlist_entry *table;
+	uint32_t table_mask;
+	/* Per-source counters, open-addressing hash table. */
+	struct allowlist_source sources[ALLOWLIST_SOURCES];
+	/* Number of packets from sources that didn't fit in the table. */
+	uint64_t untracked_accepted;
+	uint64_t untracked_dropped;
+};
+
+static void mask_in6(struct in6_addr *addr, int len)
+{
+	for (int i = 0; i < 16; i++) {
+		int bits = len - i * 8;
+		if (bits >= 8)
+			continue;
+		addr->s6_addr[i] &= bits <= 0 ? 0 : 0xff << (8 - bits);
+	}
+}
+
+static struct allowlist *allowlist_create(const struct ip_prefix *prefixes,
+		int n_prefixes)
+{
+	struct allowlist *list = arena_alloc(sizeof(*list));
+	uint32_t size = 1;
+	while (size < (uint32_t)n_prefixes * 2)
+		size *= 2;
+	list->table = arena_alloc(sizeof(*list->table) * size);
+	list->table_mask = size - 1;
+	for (uint32_t i = 0; i < size; i++)
+		list->table[i].len = -1;
+	bool has_len[129] = {false};
+	for (int i = 0; i < n_prefixes; i++) {
+		struct allowlist_entry entry = {
+			.addr = prefixes[i].addr,
+			.len = prefixes[i].len,
+		};
+		mask_in6(&entry.addr, entry.len);
+		has_len[entry.len] = true;
+		uint32_t j = hash_in6(&entry.addr, entry.len);
+		while (list->table[j & list->table_mask].len != -1)
+			j++;
+		list->table[j & list->table_mask] = entry;
+	}
+	for (int len = 128; len >= 0; len--) {
+		if (has_len[len])
+			list->lens[list->n_lens++] = len;
+	}
+	return list;
+}
+
+/* Returns true if an address matches any prefix of an allowlist. */
+static bool allowlist_match(const struct allowlist *list,
+		const struct in6_addr *addr)
+{
+	for (int i = 0; i < list->n_lens; i++) {
+		int len = list->lens[i];
+		struct in6_addr masked = *addr;
+		mask_in6(&masked, len);
+		for (uint32_t j = hash_in6(&masked, len); ; j++) {
+			const struct allowlist_entry *entry =
+				&list->table[j & list->table_mask];
+			if (entry->len == -1)
+				break;
+			if (entry->len == len && memcmp(&entry->addr, &masked,
+					sizeof(masked)) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Returns the counters of a source address, or NULL if the source table is
+ * full.
+ */
+static struct allowlist_source *allowlist_source(struct allowlist *list,
+		const struct in6_addr *addr)
+{
+	uint32_t hash = hash_in6(addr, 128);
+	for (int i = 0; i < ALLOWLIST_SOURCES; i++) {
+		struct allowlist_source *source =
+			&list->sources[(hash + i) % ALLOWLIST_SOURCES];
+		if (!source->used) {
+			source->used = true;
+			source->addr = *addr;
+			return source;
+		}
+		if (memcmp(&source->addr, addr, sizeof(*addr)) == 0)
+			return source;
+	}
+	return NULL;
+}
+
+/*
+ * Checks whether a packet received on in_sfd from src is allowed and updates
+ * per-source counters. Returns true if the packet should be processed.
+ */
+static bool source_allowed(struct connection *conn, const struct sockaddr *src)
+{
+	struct allowlist *list = conn->allowlist;
+	if (!list)
+		return true;
+	struct in6_addr addr;
+	if (!sockaddr_to_in6(src, &addr)) {
+		PROBE3(drop, conn->id, -1, DROP_SOURCE);
+		list->untracked_dropped++;
+		return false;
+	}
+	bool allowed = allowlist_match(list, &addr);
+	struct allowlist_source *source = allowlist_source(list, &addr);
+	if (!source) {
+		if (allowed) {
+			list->untracked_accepted++;
+		} else {
+			PROBE3(drop, conn->id, -1, DROP_SOURCE);
+			list->untracked_dropped++;
+		}
+		return allowed;
+	}
+	if (allowed) {
+		source->accepted++;
+		return true;
+	}
+	PROBE3(drop, conn->id, -1, DROP_SOURCE);
+	if (source->dropped++ == 0) {
+		char host[INET6_ADDRSTRLEN];
+		inet_ntop(AF_INET6, &addr, host, sizeof(host));
+		printf("%s: dropping packets from %s\n",
+				str_config(&conn->config), host);
+	}
+	return false;
+}
+
+/*
+ * Compiles allowlist prefixes into a classic BPF socket filter that drops
+ * packets from other sources in the kernel. The filter is loaded at the
+ * network header, so it works for both IPv4 and IPv6 packets. Returns the
+ * number of instructions or -1 if there are too many prefixes.
+ */
+static int compile_allowlist_filter(const struct ip_prefix *prefixes,
+		int n_prefixes, struct sock_filter *prog)
+{
+	if (n_prefixes > ALLOWLIST_MAX_KERNEL_PREFIXES)
+		return -1;
+	struct in6_addr v4_mapped;
+	memset(&v4_mapped, 0, sizeof(v4_mapped));
+	v4_mapped.s6_addr[10] = 0xff;
+	v4_mapped.s6_addr[11] = 0xff;
+	int n = 0;
+	/* Dispatch on IP version. Unknown versions are left to userspace. */
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+			SKF_NET_OFF);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4);
+	int jv6 = n++;
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 4,
+			1, 0);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	/* IPv4: compare the source address with each IPv4-mapped prefix. */
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			SKF_NET_OFF + 12);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+	int v4_accepts[ALLOWLIST_MAX_KERNEL_PREFIXES], n_v4_accepts = 0;
+	for (int i = 0; i < n_prefixes; i++) {
+		const struct ip_prefix *p = &prefixes[i];
+		int mapped_len = p->len < 96 ? p->len : 96;
+		struct in6_addr masked = p->addr, mapped = v4_mapped;
+		mask_in6(&masked, mapped_len);
+		mask_in6(&mapped, mapped_len);
+		if (memcmp(&masked, &mapped, sizeof(masked)) != 0)
+			continue;
+		int len = p->len - 96;
+		uint32_t mask = len <= 0 ? 0 : len == 32 ? 0xffffffff :
+				~(0xffffffffU >> len);
+		uint32_t value;
+		memcpy(&value, &p->addr.s6_addr[12], 4);
+		value = ntohl(value) & mask;
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TXA, 0);
+		prog[n++] = (struct sock_filter)BPF_STMT(
+				BPF_ALU | BPF_AND | BPF_K, mask);
+		v4_accepts[n_v4_accepts++] = n;
+		prog[n++] = (struct sock_filter)BPF_JUMP(
+				BPF_JMP | BPF_JEQ | BPF_K, value, 0, 0);
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	for (int i = 0; i < n_v4_accepts; i++)
+		prog[v4_accepts[i]].jt = n - v4_accepts[i] - 1;
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	/* IPv6: compare the source address word by word with each prefix. */
+	prog[jv6] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6,
+			n - jv6 - 1, 0);
+	int v6_accepts[ALLOWLIST_MAX_KERNEL_PREFIXES], n_v6_accepts = 0;
+	for (int i = 0; i < n_prefixes; i++) {
+		const struct ip_prefix *p = &prefixes[i];
+		int mismatches[4], n_mismatches = 0;
+		for (int w = 0; w < 4 && w * 32 < p->len; w++) {
+			int len = p->len - w * 32;
+			uint32_t mask = len >= 32 ? 0xffffffff :
+					~(0xffffffffU >> len);
+			uint32_t value;
+			memcpy(&value, &p->addr.s6_addr[w * 4], 4);
+			value = ntohl(value) & mask;
+			prog[n++] = (struct sock_filter)BPF_STMT(
+					BPF_LD | BPF_W | BPF_ABS,
+					SKF_NET_OFF + 8 + w * 4);
+			prog[n++] = (struct sock_filter)BPF_STMT(
+					BPF_ALU | BPF_AND | BPF_K, mask);
+			mismatches[n_mismatches++] = n;
+			prog[n++] = (struct sock_filter)BPF_JUMP(
+					BPF_JMP | BPF_JEQ | BPF_K, value, 0, 0);
+		}
+		v6_accepts[n_v6_accepts++] = n;
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, 0);
+		/* On mismatch, go on to the next prefix. */
+		for (int j = 0; j < n_mismatches; j++)
+			prog[mismatches[j]].jf = n - mismatches[j] - 1;
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	for (int i = 0; i < n_v6_accepts; i++)
+		prog[v6_accepts[i]].k = n - v6_accepts[i] - 1;
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+	return n;
+}
+
+/* Attaches an allowlist socket filter to in_sfd. */
+static void attach_allowlist_filter(struct connection *conn)
+{
+	/* Worst case: 3 insns per IPv4 prefix plus 13 per IPv6 prefix. */
+	struct sock_filter prog[16 + ALLOWLIST_MAX_KERNEL_PREFIXES * 16];
+	int n = compile_allowlist_filter(conn->config.allow,
+			conn->config.n_allow, prog);
+	if (n < 0) {
+		failx("%s: allow_kernel supports up to %d "
+				"prefixes", str_config(&conn->config),
+				ALLOWLIST_MAX_KERNEL_PREFIXES);
+	}
+	struct sock_fprog fprog = {
+		.len = n,
+		.filter = prog,
+	};
+	if (setsockopt(conn->in_sfd, SOL_SOCKET, SO_ATTACH_FILTER,
+			&fprog, sizeof(fprog)) == -1)
+		fail("setsockopt(SO_ATTACH_FILTER)");
+}
+
+/*
+ * Returns the time a packet arrived to in_sfd, or 0 if packets aren't
+ * timestamped.
+ */
+static uint64_t arrival_time_ns(const struct connection *conn,
+		struct msghdr *mh)
+{
+	if (!conn->rx_stamps)
+		return 0;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		return timespec_ns((void *)CMSG_DATA(cmsg));
+	return 0;
+}
+
+/*
+ * Sends a CAN frame received over network to can_sfd, logging it if log is
+ * set. Inlined so that log is a constant in specialized handlers.
+ */
+static ALWAYS_INLINE void forward_to_can(struct connection *conn,
+		const struct can_frame *frame, uint64_t arrival_ns, bool log)
+{
+	if (conn->bus_off) {
+		/*
+		 * Sending to a bus-off controller is doomed to fail so drop
+		 * frames silently, only probing the bus now and then in case
+		 * we missed the restart notification.
+		 */
+		uint64_t now = now_ns();
+		if (now - conn->bus_off_probe_ns < BUS_OFF_PROBE_INTERVAL_NS) {
+			PROBE3(drop, conn->id, frame->can_id, DROP_BUS_OFF);
+			conn->can_err_stats.dropped_bus_off++;
+			return;
+		}
+		conn->bus_off_probe_ns = now;
+		if (send_can_frame(conn, frame, arrival_ns) == -1) {
+			PROBE3(drop, conn->id, frame->can_id, DROP_BUS_OFF);
+			conn->can_err_stats.dropped_bus_off++;
+			return;
+		}
+		bus_off_recovered(conn);
+		if (log) {
+			printf("%s: UDP->CAN: %s\n",
+					str_config(&conn->config),
+					str_can_frame(frame));
+		}
+		return;
+	}
+	if (log) {
+		printf("%s: UDP->CAN: %s\n",
+				str_config(&conn->config), str_can_frame(frame));
+	}
+	PROF_MARK(PROF_LOG);
+	if (send_can_frame(conn, frame, arrival_ns) == -1) {
+		printf("%s: UDP->CAN: send failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+	}
+	PROF_MARK(PROF_SEND);
+}
+
+/* A struct udpcan_bridge of the library API is a struct connection. */
+static struct connection *bridge_conn(struct udpcan_bridge *bridge)
+{
+	return (struct connection *)bridge;
+}
+
+static struct udpcan_bridge *conn_bridge(struct connection *conn)
+{
+	return (struct udpcan_bridge *)conn;
+}
+
+/* Passes forwarded CAN frames to the library callbacks. */
+static void run_callbacks(struct connection *conn, enum udpcan_dir dir,
+		const struct can_frame *frames, int n_frames)
+{
+	if (conn->frame_cb) {
+		for (int i = 0; i < n_frames; i++) {
+			conn->frame_cb(conn_bridge(conn), dir, &frames[i],
+					conn->frame_cb_arg);
+		}
+	}
+	if (conn->batch_cb && n_frames > 0) {
+		conn->batch_cb(conn_bridge(conn), dir, frames, n_frames,
+				conn->batch_cb_arg);
+	}
+}
+
+/*
+ * Features the plain handlers are specialized for. can_to_udp() and
+ * udp_to_can() are compiled once for each combination of their features, and
+ * the variant matching a connection is picked at setup, so that a disabled
+ * feature costs no branch per frame.
+ */
+enum can_to_udp_feature {
+	/* Log each frame. */
+	CAN_TO_UDP_LOG = 1 << 0,
+	/* Send datagrams through the impairment stage. */
+	CAN_TO_UDP_IMPAIR = 1 << 1,
+	/* Run library callbacks. */
+	CAN_TO_UDP_CALLBACK = 1 << 2,
+	CAN_TO_UDP_VARIANTS = 1 << 3,
+};
+
+enum udp_to_can_feature {
+	/* Log each frame. */
+	UDP_TO_CAN_LOG = 1 << 0,
+	/* Check sources against the allowlist. */
+	UDP_TO_CAN_ALLOW = 1 << 1,
+	/* Read arrival timestamps. */
+	UDP_TO_CAN_STAMPS = 1 << 2,
+	/* Datagrams may be injected by the impairment stage or AF_XDP. */
+	UDP_TO_CAN_INJECT = 1 << 3,
+	/* Run library callbacks. */
+	UDP_TO_CAN_CALLBACK = 1 << 4,
+	UDP_TO_CAN_VARIANTS = 1 << 5,
+};
+
+/*
+ * Forwards a CAN frame from in_sfd to can_sfd. features is a constant in each
+ * variant, see udp_to_can_variants[].
+ */
+static ALWAYS_INLINE void udp_to_can(struct connection *conn,
+		unsigned features)
+{
+	ssize_t size;
+	struct packed_can_frame packed_frame;
+	struct sockaddr_storage src;
+	CMSG_BUFFER(control, CMSG_SPACE(sizeof(struct timespec)));
+	bool stamps = features & UDP_TO_CAN_STAMPS;
+	struct iovec iov = {
+		.iov_base = &packed_frame,
+		.iov_len = sizeof(packed_frame),
+	};
+	struct msghdr mh = {
+		.msg_name = &src,
+		.msg_namelen = sizeof(src),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = stamps ? control : NULL,
+		.msg_controllen = stamps ? sizeof(control) : 0,
+	};
+	if (features & UDP_TO_CAN_INJECT)
+		size = recv_udp(conn, &mh, MSG_DONTWAIT | MSG_TRUNC);
+	else
+		size = recv_in(conn, &mh, MSG_DONTWAIT | MSG_TRUNC);
+	if (size == -1) {
+		printf("%s: UDP->CAN: recv failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+		return;
+	}
+	uint64_t arrival_ns = stamps ? arrival_time_ns(conn, &mh) : 0;
+	PROBE3(udp_recv, conn->id, size, arrival_ns);
+	PROF_MARK(PROF_RECV);
+	if ((features & UDP_TO_CAN_ALLOW) &&
+			!source_allowed(conn, (struct sockaddr *)&src))
+		return;
+	peer_seen(conn, (struct sockaddr *)&src, mh.msg_namelen);
+	PROF_MARK(PROF_FILTER);
+	/* Empty datagrams are heartbeats. */
+	if (size == 0)
+		return;
+	if ((size_t)size < PACKED_CAN_FRAME_HDR_SIZE) {
+		PROBE3(drop, conn->id, -1, DROP_MALFORMED);
+		printf("%s: UDP->CAN: message too short: %zd < %zu\n",
+				str_config(&conn->config), size,
+				PACKED_CAN_FRAME_HDR_SIZE);
+		return;
+	}
+	if ((size_t)size > sizeof(packed_frame)) {
+		printf("%s: UDP->CAN: message truncated: %zd->%zu\n",
+				str_config(&conn->config),
+				size, sizeof(packed_frame));
+		size = sizeof(packed_frame);
+	}
+	struct can_frame frame;
+	unpack_can_frame(&packed_frame, size, &frame);
+	PROBE4(unpack, conn->id, frame.can_id, frame.can_dlc, arrival_ns);
+	PROF_MARK(PROF_DECODE);
+	if (features & UDP_TO_CAN_CALLBACK)
+		run_callbacks(conn, UDPCAN_UDP_TO_CAN, &frame, 1);
+	forward_to_can(conn, &frame, arrival_ns, features & UDP_TO_CAN_LOG);
+}
+
+/*
+ * Receive and send buffers of can_to_udp(). CAN frames are packed in place in
+ * frames[], and the send iovecs point into them, so no frame is copied.
+ */
+struct can_batch {
+	struct can_frame frames[MAX_BATCH];
+	struct iovec rx_iovs[MAX_BATCH];
+	struct mmsghdr rx_msgs[MAX_BATCH];
+	uint32_t tx_keys[MAX_BATCH];
+	struct iovec tx_iovs[MAX_BATCH];
+	struct mmsghdr tx_msgs[MAX_BATCH];
+};
+
+/*
+ * Reads all CAN frames that are queued on can_sfd, up to the batch size, and
+ * sends each of them in its own datagram. features is a constant in each
+ * variant, see can_to_udp_variants[].
+ */
+static ALWAYS_INLINE void can_to_udp(struct connection *conn,
+		unsigned features)
+{
+	struct can_batch *batch = conn->can_batch;
+	int n = recvmmsg(conn->can_sfd, batch->rx_msgs, conn->batch_size,
+			MSG_DONTWAIT, NULL);
+	conn->batch_read = n;
+	if (n == -1) {
+		printf("%s: CAN->UDP: recv failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+		return;
+	}
+	PROF_MARK(PROF_RECV);
+	int n_out = 0;
+	for (int i = 0; i < n; i++) {
+		struct can_frame *frame = &batch->frames[i];
+		PROBE3(can_recv, conn->id, frame->can_id, frame->can_dlc);
+		if (frame->can_id & CAN_ERR_FLAG) {
+			const char *desc = handle_can_error(conn, frame);
+			if (features & CAN_TO_UDP_LOG) {
+				printf("%s: CAN->UDP: error frame: %s\n",
+						str_config(&conn->config), desc);
+			}
+			if (!conn->config.forward_err_frames)
+				continue;
+		}
+		PROF_MARK(PROF_FILTER);
+		if (features & CAN_TO_UDP_LOG) {
+			printf("%s: CAN->UDP: %s\n",
+					str_config(&conn->config),
+					str_can_frame(frame));
+		}
+		PROF_MARK(PROF_LOG);
+		if (n_out != i)
+			batch->frames[n_out] = *frame;
+		n_out++;
+	}
+	if (features & CAN_TO_UDP_CALLBACK)
+		run_callbacks(conn, UDPCAN_CAN_TO_UDP, batch->frames, n_out);
+	for (int i = 0; i < n_out; i++) {
+		struct can_frame *frame = &batch->frames[i];
+		uint32_t can_id = frame->can_id;
+		struct iovec *iov = &batch->tx_iovs[i];
+		iov->iov_base = pack_can_frame_in_place(frame, &iov->iov_len);
+		batch->tx_keys[i] = can_id;
+		PROBE3(pack, conn->id, can_id, iov->iov_len);
+	}
+	PROF_MARK(PROF_ENCODE);
+	int rc;
+	if (features & CAN_TO_UDP_IMPAIR)
+		rc = send_udp_batch(conn, batch->tx_keys, batch->tx_msgs, n_out);
+	else
+		rc = transmit_udp_batch(conn, batch->tx_keys, batch->tx_msgs,
+				n_out);
+	if (rc == -1) {
+		printf("%s: CAN->UDP: send failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+	}
+	PROF_MARK(PROF_SEND);
+}
+
+/* Defines variant 4 * hi + lo of a plain handler. */
+#define HANDLER_VARIANT(handler, hi, lo) \
+	static void handler##_##hi##_##lo(struct connection *conn) \
+	{ \
+		handler(conn, (hi) * 4 + (lo)); \
+	}
+
+/* Defines variants 4 * hi to 4 * hi + 3 of a plain handler. */
+#define HANDLER_VARIANTS(handler, hi) \
+	HANDLER_VARIANT(handler, hi, 0) \
+	HANDLER_VARIANT(handler, hi, 1) \
+	HANDLER_VARIANT(handler, hi, 2) \
+	HANDLER_VARIANT(handler, hi, 3)
+
+#define HANDLER_VARIANT_PTRS(handler, hi) \
+	handler##_##hi##_0, handler##_##hi##_1, \
+	handler##_##hi##_2, handler##_##hi##_3
+
+HANDLER_VARIANTS(can_to_udp, 0)
+HANDLER_VARIANTS(can_to_udp, 1)
+
+/* Variants of can_to_udp(), indexed by features. */
+static void (*const can_to_udp_variants[CAN_TO_UDP_VARIANTS])(
+		struct connection *conn) = {
+	HANDLER_VARIANT_PTRS(can_to_udp, 0),
+	HANDLER_VARIANT_PTRS(can_to_udp, 1),
+};
+
+HANDLER_VARIANTS(udp_to_can, 0)
+HANDLER_VARIANTS(udp_to_can, 1)
+HANDLER_VARIANTS(udp_to_can, 2)
+HANDLER_VARIANTS(udp_to_can, 3)
+HANDLER_VARIANTS(udp_to_can, 4)
+HANDLER_VARIANTS(udp_to_can, 5)
+HANDLER_VARIANTS(udp_to_can, 6)
+HANDLER_VARIANTS(udp_to_can, 7)
+
+/* Variants of udp_to_can(), indexed by features. */
+static void (*const udp_to_can_variants[UDP_TO_CAN_VARIANTS])(
+		struct connection *conn) = {
+	HANDLER_VARIANT_PTRS(udp_to_can, 0),
+	HANDLER_VARIANT_PTRS(udp_to_can, 1),
+	HANDLER_VARIANT_PTRS(udp_to_can, 2),
+	HANDLER_VARIANT_PTRS(udp_to_can, 3),
+	HANDLER_VARIANT_PTRS(udp_to_can, 4),
+	HANDLER_VARIANT_PTRS(udp_to_can, 5),
+	HANDLER_VARIANT_PTRS(udp_to_can, 6),
+	HANDLER_VARIANT_PTRS(udp_to_can, 7),
+};
+
+/*
+ * Seals CAN frames into authenticated datagrams and sends them to OUT_HOST.
+ * Frames normally share a single datagram, so that the MAC is computed once
+ * for all of them. With the hash policy, runs of frames that go to the same
+ * destination are sealed separately, and so are runs of frames of the same qos
+ * class. Returns -1 if sending failed.
+ */
+static int send_auth_frames(struct connection *conn,
+		const struct can_frame *frames, int n_frames)
+{
+	bool split = conn->config.dest_policy == DEST_POLICY_HASH &&
+			conn->n_dests > 1;
+	struct destination *dests[MAX_BATCH];
+	if (split) {
+		/* As in select_destinations(). */
+		if (conn->config.learn_peers)
+			expire_peers(conn);
+		for (int i = 0; i < n_frames; i++)
+			dests[i] = select_destination(conn, frames[i].can_id);
+	}
+	int rc = 0;
+	int start = 0;
+	for (int i = 1; i <= n_frames; i++) {
+		if (i < n_frames && (!split || dests[i] == dests[start]) &&
+				(!conn->qos ||
+				qos_classify(&conn->config, frames[i].can_id) ==
+				qos_classify(&conn->config, frames[start].can_id)))
+			continue;
+		size_t size = auth_seal(conn->auth, &frames[start], i - start);
+		PROBE3(pack, conn->id, frames[start].can_id, size);
+		PROF_MARK(PROF_ENCODE);
+		if (send_udp(conn, frames[start].can_id,
+				conn->auth->tx_buf, size) == -1)
+			rc = -1;
+		PROF_MARK(PROF_SEND);
+		start = i;
+	}
+	return rc;
+}
+
+/*
+ * Authenticated counterpart of udp_to_can(): each datagram carries a batch of
+ * CAN frames.
+ */
+static void udp_to_can_auth(struct connection *conn)
+{
+	struct auth_state *auth = conn->auth;
+	ssize_t size;
+	struct sockaddr_storage src;
+	CMSG_BUFFER(control, CMSG_SPACE(sizeof(struct timespec)));
+	struct iovec iov = {
+		.iov_base = auth->rx_buf,
+		.iov_len = sizeof(auth->rx_buf),
+	};
+	struct msghdr mh = {
+		.msg_name = &src,
+		.msg_namelen = sizeof(src),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = conn->rx_stamps ? control : NULL,
+		.msg_controllen = conn->rx_stamps ? sizeof(control) : 0,
+	};
+	if ((size = recv_udp(conn, &mh, MSG_DONTWAIT | MSG_TRUNC)) == -1) {
+		printf("%s: UDP->CAN: recv failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+		return;
+	}
+	uint64_t arrival_ns = arrival_time_ns(conn, &mh);
+	PROBE3(udp_recv, conn->id, size, arrival_ns);
+	PROF_MARK(PROF_RECV);
+	if (!source_allowed(conn, (struct sockaddr *)&src))
+		return;
+	PROF_MARK(PROF_FILTER);
+	if ((size_t)size > sizeof(auth->rx_buf)) {
+		PROBE3(drop, conn->id, -1, DROP_AUTH);
+		auth->malformed++;
+		return;
+	}
+	/* Only authenticated datagrams prove that the peer is alive. */
+	int n_frames = auth_open(auth, size);
+	PROF_MARK(PROF_DECODE);
+	if (n_frames == -1) {
+		PROBE3(drop, conn->id, -1, DROP_AUTH);
+		return;
+	}
+	peer_seen(conn, (struct sockaddr *)&src, mh.msg_namelen);
+	PROF_MARK(PROF_FILTER);
+	run_callbacks(conn, UDPCAN_UDP_TO_CAN, auth->udp_frames, n_frames);
+	for (int i = 0; i < n_frames; i++) {
+		const struct can_frame *frame = &auth->udp_frames[i];
+		PROBE4(unpack, conn->id, frame->can_id, frame->can_dlc,
+				arrival_ns);
+		forward_to_can(conn, frame, arrival_ns, !conn->config.quiet);
+	}
+}
+
+/*
+ * Authenticated counterpart of can_to_udp(): reads all CAN frames that are
+ * queued on can_sfd, up to the batch size, and sends them in one datagram.
+ * Frames are never held back waiting for more, so batching adds no latency,
+ * unless batch_latency allows it, see struct batch_ctl.
+ */
+static void can_to_udp_auth(struct connection *conn)
+{
+	struct auth_state *auth = conn->auth;
+	int n = recvmmsg(conn->can_sfd, auth->can_msgs, conn->batch_size,
+			MSG_DONTWAIT, NULL);
+	conn->batch_read = n;
+	PROF_MARK(PROF_RECV);
+	if (n == -1) {
+		printf("%s: CAN->UDP: recv failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+		return;
+	}
+	int n_frames = 0;
+	for (int i = 0; i < n; i++) {
+		struct can_frame *frame = &auth->can_frames[i];
+		PROBE3(can_recv, conn->id, frame->can_id, frame->can_dlc);
+		if (frame->can_id & CAN_ERR_FLAG) {
+			const char *desc = handle_can_error(conn, frame);
+			if (!conn->config.quiet) {
+				printf("%s: CAN->UDP: error frame: %s\n",
+						str_config(&conn->config), desc);
+			}
+			if (!conn->config.forward_err_frames)
+				continue;
+		}
+		PROF_MARK(PROF_FILTER);
+		if (!conn->config.quiet) {
+			printf("%s: CAN->UDP: %s\n",
+					str_config(&conn->config),
+					str_can_frame(frame));
+		}
+		PROF_MARK(PROF_LOG);
+		if (n_frames != i)
+			auth->can_frames[n_frames] = *frame;
+		n_frames++;
+	}
+	run_callbacks(conn, UDPCAN_CAN_TO_UDP, auth->can_frames, n_frames);
+	if (send_auth_frames(conn, auth->can_frames, n_frames) == -1) {
+		printf("%s: CAN->UDP: send failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+	}
+}
+
+/* Forwards a J1939 message from in_sfd to can_sfd. */
+static void udp_to_j1939(struct connection *conn)
+{
+	ssize_t size;
+	struct packed_j1939_msg msg;
+	struct sockaddr_storage src;
+	struct iovec iov = {
+		.iov_base = &msg,
+		.iov_len = sizeof(msg),
+	};
+	struct msghdr mh = {
+		.msg_name = &src,
+		.msg_namelen = sizeof(src),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	if ((size = recv_udp(conn, &mh, MSG_DONTWAIT | MSG_TRUNC)) == -1) {
+		printf("%s: UDP->J1939: recv failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+		return;
+	}
+	/* J1939 connections don't timestamp packets, see tx_stamps. */
+	PROBE3(udp_recv, conn->id, size, 0);
+	PROF_MARK(PROF_RECV);
+	if (!source_allowed(conn, (struct sockaddr *)&src))
+		return;
+	peer_seen(conn, (struct sockaddr *)&src, mh.msg_namelen);
+	PROF_MARK(PROF_FILTER);
+	/* Empty datagrams are heartbeats. */
+	if (size == 0)
+		return;
+	if ((size_t)size < sizeof(msg.hdr)) {
+		PROBE3(drop, conn->id, -1, DROP_MALFORMED);
+		printf("%s: UDP->J1939: message too short: %zd < %zu\n",
+				str_config(&conn->config), size,
+				sizeof(msg.hdr));
+		return;
+	}
+	if ((size_t)size > sizeof(msg)) {
+		printf("%s: UDP->J1939: message truncated: %zd->%zu\n",
+				str_config(&conn->config), size, sizeof(msg));
+		size = sizeof(msg);
+	}
+	size_t data_size = size - sizeof(msg.hdr);
+	if (!conn->config.quiet) {
+		printf("%s: UDP->J1939: %s\n", str_config(&conn->config),
+				str_j1939_msg(&msg, data_size));
+	}
+	PROF_MARK(PROF_LOG);
+	if (conn->config.j1939_addr == J1939_NO_ADDR) {
+		printf("%s: UDP->J1939: no source address configured\n",
+				str_config(&conn->config));
+		return;
+	}
+	uint32_t pgn = ntohl(msg.hdr.pgn);
+	if (pgn > J1939_PGN_MAX || msg.hdr.priority > 7) {
+		printf("%s: UDP->J1939: invalid PGN or priority\n",
+				str_config(&conn->config));
+		return;
+	}
+	/* Changing priority costs a syscall so only do it when needed. */
+	if (msg.hdr.priority != conn->j1939_send_prio) {
+		int prio = msg.hdr.priority;
+		if (setsockopt(conn->can_sfd, SOL_CAN_J1939,
+				SO_J1939_SEND_PRIO, &prio, sizeof(prio)) == -1) {
+			printf("%s: UDP->J1939: failed to set priority: %s\n",
+					str_config(&conn->config),
+					strerror(errno));
+			return;
+		}
+		conn->j1939_send_prio = prio;
+	}
+	struct sockaddr_can addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_addr.j1939.name = J1939_NO_NAME;
+	addr.can_addr.j1939.pgn = pgn;
+	addr.can_addr.j1939.addr = msg.hdr.dst_addr;
+	PROBE4(can_send, conn->id, pgn, data_size, 0);
+	PROF_MARK(PROF_DECODE);
+	if (sendto(conn->can_sfd, msg.data, data_size, 0,
+			(struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		printf("%s: UDP->J1939: send failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+	}
+	PROF_MARK(PROF_SEND);
+}
+
+/* Forwards a J1939 message from can_sfd to OUT_HOST. */
+static void j1939_to_udp(struct connection *conn)
+{
+	struct packed_j1939_msg msg;
+	struct sockaddr_can addr;
+	CMSG_BUFFER(control, CMSG_SPACE(sizeof(uint8_t)) * 2 +
+			CMSG_SPACE(sizeof(name_t)));
+	struct iovec iov = {
+		.iov_base = msg.data,
+		.iov_len = sizeof(msg.data),
+	};
+	struct msghdr mh = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	ssize_t size;
+	if ((size = recvmsg(conn->can_sfd, &mh,
+			MSG_DONTWAIT | MSG_TRUNC)) == -1) {
+		printf("%s: J1939->UDP: recv failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+		return;
+	}
+	if ((size_t)size > sizeof(msg.data)) {
+		printf("%s: J1939->UDP: message truncated: %zd->%zu\n",
+				str_config(&conn->config), size,
+				sizeof(msg.data));
+		size = sizeof(msg.data);
+	}
+	PROBE3(can_recv, conn->id, addr.can_addr.j1939.pgn, size);
+	PROF_MARK(PROF_RECV);
+	msg.hdr.pgn = htonl(addr.can_addr.j1939.pgn);
+	msg.hdr.src_addr = addr.can_addr.j1939.addr;
+	msg.hdr.dst_addr = J1939_NO_ADDR;
+	msg.hdr.priority = 0;
+	msg.hdr.reserved = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_CAN_J1939)
+			continue;
+		if (cmsg->cmsg_type == SCM_J1939_DEST_ADDR)
+			msg.hdr.dst_addr = *CMSG_DATA(cmsg);
+		else if (cmsg->cmsg_type == SCM_J1939_PRIO)
+			msg.hdr.priority = *CMSG_DATA(cmsg);
+	}
+	PROF_MARK(PROF_ENCODE);
+	if (!conn->config.quiet) {
+		printf("%s: J1939->UDP: %s\n", str_config(&conn->config),
+				str_j1939_msg(&msg, size));
+	}
+	PROF_MARK(PROF_LOG);
+	if (send_udp(conn, addr.can_addr.j1939.pgn,
+			&msg, sizeof(msg.hdr) + size) == -1) {
+		printf("%s: J1939->UDP: send failed: %s\n",
+				str_config(&conn->config), strerror(errno));
+	}
+	PROF_MARK(PROF_SEND);
+}
+
+/* Returns the number of elements of a '+'-separated list. */
+static int list_length(const char *s)
+{
+	int n = 1;
+	for (; *s; s++)
+		n += *s == '+';
+	return n;
+}
+
+/*
+ * Creates the destinations listed in OUT_HOST and OUT_PORT. If one of the
+ * lists has a single element, it is used with every element of the other.
+ * Their addresses are set by resolve_destinations(). Hosts and ports point
+ * into copies of the lists held by the first destination and freed by
+ * free_connection().
+ */
+static void setup_destinations(struct connection *conn)
+{
+	if (conn->config.learn_peers) {
+		/* Destinations will be learned from incoming packets. */
+		conn->dests = arena_alloc(sizeof(*conn->dests) *
+				conn->config.max_peers);
+		conn->n_dests = 0;
+		return;
+	}
+	int n_hosts = list_length(conn->config.out_host);
+	int n_ports = list_length(conn->config.out_port);
+	if (n_hosts != n_ports && n_hosts != 1 && n_ports != 1) {
+		failx("%s: OUT_HOST and OUT_PORT lists differ "
+				"in length", str_config(&conn->config));
+	}
+	int n_dests = n_hosts > n_ports ? n_hosts : n_ports;
+	conn->dests = arena_alloc(sizeof(*conn->dests) * n_dests);
+	char *hosts = conn->dests[0].host = xstrdup(conn->config.out_host);
+	char *ports = conn->dests[0].port = xstrdup(conn->config.out_port);
+	for (int i = 0; i < n_dests; i++) {
+		struct destination *dest = &conn->dests[i];
+		dest->conn = conn;
+		dest->host = i < n_hosts ? strsep(&hosts, "+") :
+				conn->dests[0].host;
+		dest->port = i < n_ports ? strsep(&ports, "+") :
+				conn->dests[0].port;
+		dest->sfd = -1;
+	}
+	conn->n_dests = n_dests;
+}
+
+/* Frees the memory of a connection that is not in the arena. */
+static void free_connection(struct connection *conn)
+{
+	if (!conn->config.learn_peers && conn->dests) {
+		free(conn->dests[0].host);
+		free(conn->dests[0].port);
+	}
+	free_config(&conn->config);
+}
+
+/* Resolution of a distinct OUT_HOST and OUT_PORT pair. */
+struct resolution {
+	/* Host, port and result. */
+	struct gaicb gaicb;
+	/* getaddrinfo() error code, 0 on success. */
+	int error;
+	/* Next resolution in the same hash bucket. */
+	struct resolution *next;
+};
+
+static uint32_t hash_string(uint32_t hash, const char *s)
+{
+	/* FNV-1a */
+	while (*s)
+		hash = (hash ^ (uint8_t)*s++) * 16777619U;
+	return (hash ^ 0xff) * 16777619U;
+}
+
+/*
+ * Sets the address of a destination to the first one resolved with the address
+ * family of in_sfd, so that packets are sent from in_sfd. Otherwise, e.g. for
+ * an IPv6-only host while IN_PORT is bound to IPv4, the destination gets a
+ * socket of its own. Prints an error and returns -1 on failure.
+ */
+static int open_destination(struct destination *dest,
+		const struct resolution *res)
+{
+	struct connection *conn = dest->conn;
+	if (res->error != 0) {
+		warnx("Failed to resolve UDP address '%s:%s': %s",
+				dest->host, dest->port,
+				gai_strerror(res->error));
+		return -1;
+	}
+	const struct addrinfo *ai = res->gaicb.ar_result;
+	for (const struct addrinfo *rp = ai; rp != NULL; rp = rp->ai_next) {
+		if (rp->ai_family != conn->in_family)
+			continue;
+		dest->sfd = conn->in_sfd;
+		memcpy(&dest->addr, rp->ai_addr, rp->ai_addrlen);
+		dest->addrlen = rp->ai_addrlen;
+		return 0;
+	}
+	dest->sfd = connect_udp(ai, dest->host, dest->port);
+	if (dest->sfd == -1)
+		return -1;
+	dest->addrlen = sizeof(dest->addr);
+	if (getpeername(dest->sfd, (struct sockaddr *)&dest->addr,
+			&dest->addrlen) == -1) {
+		warn("getpeername");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Resolves the addresses of the destinations of all connections. Each
+ * distinct host and port is resolved once. Numeric addresses are converted
+ * right away, host names are looked up concurrently with getaddrinfo_a() so
+ * that startup doesn't wait for one name server reply after another.
+ */
+static void resolve_destinations(struct connection *connections,
+		int n_connections)
+{
+	int n_dests = 0;
+	for (int i = 0; i < n_connections; i++) {
+		if (!connections[i].config.learn_peers)
+			n_dests += connections[i].n_dests;
+	}
+	if (n_dests == 0)
+		return;
+	int n_buckets = 1;
+	while (n_buckets < n_dests)
+		n_buckets *= 2;
+	struct resolution **buckets = xmalloc(sizeof(*buckets) * n_buckets);
+	memset(buckets, 0, sizeof(*buckets) * n_buckets);
+	struct resolution *res = xmalloc(sizeof(*res) * n_dests);
+	struct resolution **dest_res = xmalloc(sizeof(*dest_res) * n_dests);
+	struct gaicb **lookups = xmalloc(sizeof(*lookups) * n_dests);
+	int n_res = 0;
+	int n_lookups = 0;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	struct addrinfo numeric_hints = hints;
+	numeric_hints.ai_flags |= AI_NUMERICHOST;
+	int k = 0;
+	for (int i = 0; i < n_connections; i++) {
+		struct connection *conn = &connections[i];
+		if (conn->config.learn_peers)
+			continue;
+		for (int j = 0; j < conn->n_dests; j++) {
+			const char *host = conn->dests[j].host;
+			const char *port = conn->dests[j].port;
+			uint32_t hash = hash_string(hash_string(2166136261U,
+					host), port) & (n_buckets - 1);
+			struct resolution *r = buckets[hash];
+			while (r && (strcmp(r->gaicb.ar_name, host) != 0 ||
+					strcmp(r->gaicb.ar_service, port) != 0))
+				r = r->next;
+			if (!r) {
+				r = &res[n_res++];
+				memset(r, 0, sizeof(*r));
+				r->gaicb.ar_name = host;
+				r->gaicb.ar_service = port;
+				r->gaicb.ar_request = &hints;
+				r->next = buckets[hash];
+				buckets[hash] = r;
+				r->error = getaddrinfo(host, port,
+						&numeric_hints,
+						&r->gaicb.ar_result);
+				if (r->error == EAI_NONAME)
+					lookups[n_lookups++] = &r->gaicb;
+			}
+			dest_res[k++] = r;
+		}
+	}
+	bool failed = false;
+	if (n_lookups > 0) {
+		int errcode = getaddrinfo_a(GAI_WAIT, lookups, n_lookups,
+				NULL);
+		if (errcode != 0 && errcode != EAI_ALLDONE) {
+			warnx("Failed to resolve UDP addresses: %s",
+					gai_strerror(errcode));
+			failed = true;
+		}
+		for (int i = 0; i < n_lookups; i++) {
+			container_of(lookups[i], struct resolution,
+					gaicb)->error = gai_error(lookups[i]);
+		}
+	}
+	k = 0;
+	for (int i = 0; i < n_connections && !failed; i++) {
+		struct connection *conn = &connections[i];
+		if (conn->config.learn_peers)
+			continue;
+		for (int j = 0; j < conn->n_dests && !failed; j++) {
+			failed = open_destination(&conn->dests[j],
+					dest_res[k++]) == -1;
+		}
+	}
+	for (int i = 0; i < n_res; i++) {
+		if (res[i].error == 0)
+			freeaddrinfo(res[i].gaicb.ar_result);
+	}
+	free(lookups);
+	free(dest_res);
+	free(res);
+	free(buckets);
+	/* The error has been printed. */
+	if (failed)
+		fail_exit();
+}
+
+/*
+ * Reads a 128-bit key given as 32 hex digits from a file. Whitespace is
+ * ignored.
+ */
+static void read_auth_key(const char *path, uint64_t key[2])
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		fail("%s", path);
+	uint8_t bytes[16];
+	int n_digits = 0;
+	int c;
+	while ((c = fgetc(f)) != EOF) {
+		if (isspace(c))
+			continue;
+		if (!isxdigit(c) || n_digits == 2 * sizeof(bytes)) {
+			fclose(f);
+			failx("%s: expected 32 hex digits", path);
+		}
+		int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+		if (n_digits % 2 == 0)
+			bytes[n_digits / 2] = v << 4;
+		else
+			bytes[n_digits / 2] |= v;
+		n_digits++;
+	}
+	fclose(f);
+	if (n_digits != 2 * sizeof(bytes))
+		failx("%s: expected 32 hex digits", path);
+	memcpy(&key[0], bytes, 8);
+	memcpy(&key[1], bytes + 8, 8);
+	key[0] = le64toh(key[0]);
+	key[1] = le64toh(key[1]);
+}
+
+/* Switches a connection to the authenticated datagram format. */
+static void setup_auth(struct connection *conn)
+{
+	if (conn->config.can_proto != CAN_PROTO_RAW) {
+		failx("%s: auth is not supported in J1939 mode",
+				str_config(&conn->config));
+	}
+	struct auth_state *auth = arena_alloc(sizeof(*auth));
+	read_auth_key(conn->config.auth_key_file, auth->key);
+	if (getrandom(&auth->sender_id, sizeof(auth->sender_id), 0) !=
+			sizeof(auth->sender_id))
+		fail("getrandom");
+	auth->seq = now_realtime_ns();
+	auth->max_skew_ns = conn->config.auth_max_skew_ms * 1000000ULL;
+	for (int i = 0; i < MAX_BATCH; i++) {
+		auth->can_iovs[i].iov_base = &auth->can_frames[i];
+		auth->can_iovs[i].iov_len = sizeof(auth->can_frames[i]);
+		auth->can_msgs[i].msg_hdr.msg_iov = &auth->can_iovs[i];
+		auth->can_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	if (conn->config.batch == 0)
+		conn->config.batch = MAX_BATCH;
+	conn->batch_size = conn->config.batch;
+	conn->auth = auth;
+	conn->can_to_udp = can_to_udp_auth;
+	conn->udp_to_can = udp_to_can_auth;
+}
+
+/*
+ * Sets up the buffers of can_to_udp(). Handlers run one at a time, so all
+ * connections of an instance share the buffers in *shared.
+ */
+static void setup_can_batch(struct connection *conn,
+		struct can_batch **shared)
+{
+	struct can_batch *batch = *shared;
+	if (!batch) {
+		batch = *shared = arena_alloc(sizeof(*batch));
+		for (int i = 0; i < MAX_BATCH; i++) {
+			batch->rx_iovs[i].iov_base = &batch->frames[i];
+			batch->rx_iovs[i].iov_len = sizeof(batch->frames[i]);
+			batch->rx_msgs[i].msg_hdr.msg_iov = &batch->rx_iovs[i];
+			batch->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+			batch->tx_msgs[i].msg_hdr.msg_iov = &batch->tx_iovs[i];
+			batch->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+	if (conn->config.batch == 0)
+		conn->config.batch = MAX_BATCH;
+	conn->batch_size = conn->config.batch;
+	conn->can_batch = batch;
+}
+
+/*
+ * Sets up the can_prio classes of a connection. Checks that their priorities
+ * may be used, as frames carrying them would be rejected otherwise.
+ */
+static void setup_can_prio(struct connection *conn)
+{
+	const struct config *config = &conn->config;
+	if (config->can_proto != CAN_PROTO_RAW) {
+		failx("%s: can_prio is not supported in J1939 mode",
+				str_config(config));
+	}
+	for (int i = 0; i < config->n_can_prio; i++) {
+		int priority = config->can_prio[i].priority;
+		if (setsockopt(conn->can_sfd, SOL_SOCKET, SO_PRIORITY,
+				&priority, sizeof(priority)) == -1)
+			fail("%s: SO_PRIORITY %d", str_config(config),
+					priority);
+	}
+	int priority = 0;
+	if (setsockopt(conn->can_sfd, SOL_SOCKET, SO_PRIORITY,
+			&priority, sizeof(priority)) == -1)
+		fail("setsockopt(SO_PRIORITY)");
+	conn->can_prio = arena_alloc(sizeof(*conn->can_prio));
+}
+
+/*
+ * Opens the sockets of a connection and allocates its state. can_batch is
+ * shared by the connections of an instance, see setup_can_batch().
+ */
+static void setup_connection(struct connection *conn,
+		struct can_batch **can_batch)
+{
+	switch (conn->config.can_proto) {
+	case CAN_PROTO_RAW:
+		conn->can_sfd = bind_can(conn->config.can_ifname);
+		/* Variants with all features, see specialize_handlers(). */
+		conn->can_to_udp = can_to_udp_variants[CAN_TO_UDP_VARIANTS - 1];
+		conn->udp_to_can = udp_to_can_variants[UDP_TO_CAN_VARIANTS - 1];
+		break;
+	case CAN_PROTO_J1939:
+		conn->can_sfd = bind_j1939(conn->config.can_ifname,
+				conn->config.j1939_addr);
+		conn->can_to_udp = j1939_to_udp;
+		conn->udp_to_can = udp_to_j1939;
+		conn->j1939_send_prio = -1;
+		if (conn->config.tx_stamps || conn->config.txtime) {
+			failx("%s: tx_stamps and txtime are not "
+					"supported in J1939 mode",
+					str_config(&conn->config));
+		}
+		for (int i = 0; i < conn->config.n_cyclic; i++) {
+			if (!conn->config.cyclic[i].to_udp) {
+				failx("%s: cyclic CAN frames are "
+						"not supported in J1939 mode",
+						str_config(&conn->config));
+			}
+		}
+		break;
+	}
+	conn->in_sfd = bind_udp(conn->config.in_port, &conn->in_family);
+	if (conn->config.auth_max_skew_ms != 0 && !conn->config.auth_key_file)
+		failx("%s: auth_max_skew requires auth",
+				str_config(&conn->config));
+	if (conn->config.auth_key_file)
+		setup_auth(conn);
+	else if (conn->config.can_proto == CAN_PROTO_RAW)
+		setup_can_batch(conn, can_batch);
+	else if (conn->config.batch != 0 || conn->config.batch_latency_us != 0)
+		failx("%s: batch and batch_latency are not "
+				"supported in J1939 mode",
+				str_config(&conn->config));
+	if (conn->config.n_qos > 0) {
+		/* J1939 packets are keyed by PGN, not by CAN id. */
+		if (conn->config.can_proto != CAN_PROTO_RAW) {
+			failx("%s: qos is not supported in J1939 "
+					"mode", str_config(&conn->config));
+		}
+		conn->qos = arena_alloc(sizeof(*conn->qos));
+		qos_build_controls(conn);
+	}
+	if (conn->config.n_can_prio > 0)
+		setup_can_prio(conn);
+	if (conn->config.n_allow > 0) {
+		conn->allowlist = allowlist_create(conn->config.allow,
+				conn->config.n_allow);
+		if (conn->config.allow_kernel)
+			attach_allowlist_filter(conn);
+	} else if (conn->config.allow_kernel) {
+		failx("%s: allow_kernel requires allow",
+				str_config(&conn->config));
+	}
+	if (conn->config.tx_stamps || conn->config.txtime) {
+		enable_rx_stamps(conn->in_sfd);
+		conn->rx_stamps = true;
+	}
+	if (conn->config.txtime)
+		enable_txtime(conn->can_sfd);
+	if (conn->config.tx_stamps) {
+		enable_tx_stamps(conn->can_sfd);
+		conn->tx_stamps = arena_alloc(sizeof(*conn->tx_stamps));
+		/* Make sure stale ring entries never match a key. */
+		for (int i = 0; i < TX_STAMP_RING_SIZE; i++)
+			conn->tx_stamps->ring[i].key = i + 1;
+	}
+	setup_destinations(conn);
+}
+
+/* Inserts the impairment stage into a connection if configured. */
+static void setup_impairment(struct timer_wheel *wheel,
+		struct connection *conn)
+{
+	const struct impair_config *cfg = &conn->config.impair;
+	if (cfg->loss == 0 && cfg->dup == 0 && cfg->reorder == 0 &&
+			cfg->delay_ms == 0 && cfg->jitter_ms == 0 &&
+			cfg->rate_kbit == 0)
+		return;
+	if (cfg->reorder != 0 && cfg->delay_ms == 0 && cfg->jitter_ms == 0) {
+		failx("%s: impair_reorder requires impair_delay",
+				str_config(&conn->config));
+	}
+	struct impairment *imp = arena_alloc(sizeof(*imp));
+	imp->conn = conn;
+	imp->wheel = wheel;
+	imp->packets = arena_alloc(sizeof(*imp->packets) * IMPAIR_MAX_QUEUED);
+	for (int i = 0; i < IMPAIR_MAX_QUEUED; i++) {
+		imp->packets[i].next_free = imp->free_packets;
+		imp->free_packets = &imp->packets[i];
+	}
+	imp->tx.imp = imp;
+	imp->tx.rng = cfg->seed;
+	imp->rx.imp = imp;
+	imp->rx.rx = true;
+	/* Independent streams, so that one direction doesn't skew the other. */
+	imp->rx.rng = cfg->seed ^ 0xd1b54a32d192ed03ULL;
+	imp->tx_enabled = cfg->dir != IMPAIR_RX;
+	if (cfg->dir != IMPAIR_TX) {
+		imp->udp_to_can = conn->udp_to_can;
+		conn->udp_to_can = impair_udp_to_can;
+	}
+	conn->impair = imp;
+}
+
+/* Returns the features the plain CAN->UDP handler of a connection needs. */
+static unsigned can_to_udp_features(const struct connection *conn)
+{
+	unsigned features = 0;
+	if (!conn->config.quiet)
+		features |= CAN_TO_UDP_LOG;
+	if (conn->impair && conn->impair->tx_enabled)
+		features |= CAN_TO_UDP_IMPAIR;
+	if (conn->frame_cb || conn->batch_cb)
+		features |= CAN_TO_UDP_CALLBACK;
+	return features;
+}
+
+/* Returns the features the plain UDP->CAN handler of a connection needs. */
+static unsigned udp_to_can_features(const struct connection *conn)
+{
+	const struct impairment *imp = conn->impair;
+	unsigned features = 0;
+	if (!conn->config.quiet)
+		features |= UDP_TO_CAN_LOG;
+	if (conn->allowlist)
+		features |= UDP_TO_CAN_ALLOW;
+	if (conn->rx_stamps)
+		features |= UDP_TO_CAN_STAMPS;
+	if (conn->xdp || (imp && imp->udp_to_can))
+		features |= UDP_TO_CAN_INJECT;
+	if (conn->frame_cb || conn->batch_cb)
+		features |= UDP_TO_CAN_CALLBACK;
+	return features;
+}
+
+#ifdef UDPCAN_GENERIC_HANDLERS
+/*
+ * Plain handlers that test the features of the connection on each call
+ * instead of being specialized, to measure what specialization saves (make
+ * specialize-compare).
+ */
+static void can_to_udp_generic(struct connection *conn)
+{
+	can_to_udp(conn, can_to_udp_features(conn));
+}
+
+static void udp_to_can_generic(struct connection *conn)
+{
+	udp_to_can(conn, udp_to_can_features(conn));
+}
+#endif
+
+/*
+ * Replaces the plain handlers of a connection with the variants specialized
+ * for its features. Must be called once the connection is fully set up.
+ */
+static void specialize_handlers(struct connection *conn)
+{
+	if (conn->config.can_proto != CAN_PROTO_RAW || conn->auth)
+		return;
+	struct impairment *imp = conn->impair;
+#ifdef UDPCAN_GENERIC_HANDLERS
+	void (*can_to_udp_handler)(struct connection *) = can_to_udp_generic;
+	void (*udp_to_can_handler)(struct connection *) = udp_to_can_generic;
+#else
+	void (*can_to_udp_handler)(struct connection *) =
+			can_to_udp_variants[can_to_udp_features(conn)];
+	void (*udp_to_can_handler)(struct connection *) =
+			udp_to_can_variants[udp_to_can_features(conn)];
+#endif
+	conn->can_to_udp = can_to_udp_handler;
+	/* The impairment stage calls the handler it was inserted before. */
+	if (imp && imp->udp_to_can)
+		imp->udp_to_can = udp_to_can_handler;
+	else
+		conn->udp_to_can = udp_to_can_handler;
+}
+
+/* Jump targets of the XDP program. */
+enum xdp_label {
+	XDP_LABEL_IPV4,
+	XDP_LABEL_PORT,
+	XDP_LABEL_REDIRECT,
+	XDP_LABEL_PASS,
+	XDP_LABELS,
+};
+
+/* eBPF program being assembled, with jumps resolved at the end. */
+struct bpf_asm {
+	struct bpf_insn *insns;
+	/* Label each instruction jumps to, -1 if none. */
+	int *targets;
+	int n, max;
+	int labels[XDP_LABELS];
+};
+
+static void bpf_emit(struct bpf_asm *a, uint8_t code, uint8_t dst,
+		uint8_t src, int16_t off, int32_t imm, int target)
+{
+	if (a->n == a->max) {
+		a->max = a->max ? a->max * 2 : 64;
+		a->insns = xrealloc(a->insns, sizeof(*a->insns) * a->max);
+		a->targets = xrealloc(a->targets, sizeof(*a->targets) * a->max);
+	}
+	struct bpf_insn *insn = &a->insns[a->n];
+	memset(insn, 0, sizeof(*insn));
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+	a->targets[a->n++] = target;
+}
+
+static void bpf_mov_reg(struct bpf_asm *a, uint8_t dst, uint8_t src)
+{
+	bpf_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0, -1);
+}
+
+static void bpf_add_reg(struct bpf_asm *a, uint8_t dst, uint8_t src)
+{
+	bpf_emit(a, BPF_ALU64 | BPF_ADD | BPF_X, dst, src, 0, 0, -1);
+}
+
+static void bpf_alu_imm(struct bpf_asm *a, uint8_t op, uint8_t dst,
+		int32_t imm)
+{
+	bpf_emit(a, BPF_ALU64 | op | BPF_K, dst, 0, 0, imm, -1);
+}
+
+static void bpf_load(struct bpf_asm *a, uint8_t size, uint8_t dst,
+		uint8_t src, int16_t off)
+{
+	bpf_emit(a, BPF_LDX | BPF_MEM | size, dst, src, off, 0, -1);
+}
+
+static void bpf_jmp_imm(struct bpf_asm *a, uint8_t op, uint8_t dst,
+		int32_t imm, enum xdp_label label)
+{
+	bpf_emit(a, BPF_JMP | op | BPF_K, dst, 0, 0, imm, label);
+}
+
+static void bpf_jmp_reg(struct bpf_asm *a, uint8_t op, uint8_t dst,
+		uint8_t src, enum xdp_label label)
+{
+	bpf_emit(a, BPF_JMP | op | BPF_X, dst, src, 0, 0, label);
+}
+
+static void bpf_label(struct bpf_asm *a, enum xdp_label label)
+{
+	a->labels[label] = a->n;
+}
+
+/*
+ * Assembles the XDP program of an interface. It redirects UDP packets to the
+ * ports of the interface's connections to the AF_XDP socket of the queue
+ * they arrived on, and passes anything else to the kernel, including packets
+ * for queues without a socket. Registers: r2 points to the network header
+ * then, for IPv4, to the IP options end minus 20 bytes; r3 is the end of the
+ * packet; r5 is the value being checked.
+ */
+static void assemble_xdp_prog(struct bpf_asm *a,
+		const struct xdp_iface *iface)
+{
+	const int eth = XDP_ETH_HDR_SIZE;
+	bpf_mov_reg(a, BPF_REG_6, BPF_REG_1);
+	bpf_load(a, BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data));
+	bpf_load(a, BPF_W, BPF_REG_3, BPF_REG_1,
+			offsetof(struct xdp_md, data_end));
+	bpf_mov_reg(a, BPF_REG_4, BPF_REG_2);
+	bpf_alu_imm(a, BPF_ADD, BPF_REG_4, eth);
+	bpf_jmp_reg(a, BPF_JGT, BPF_REG_4, BPF_REG_3, XDP_LABEL_PASS);
+	bpf_load(a, BPF_H, BPF_REG_5, BPF_REG_2, 12);
+	bpf_jmp_imm(a, BPF_JEQ, BPF_REG_5, htons(ETH_P_IP), XDP_LABEL_IPV4);
+	bpf_jmp_imm(a, BPF_JNE, BPF_REG_5, htons(ETH_P_IPV6), XDP_LABEL_PASS);
+
+	/* IPv6 without extension headers. */
+	bpf_mov_reg(a, BPF_REG_4, BPF_REG_2);
+	bpf_alu_imm(a, BPF_ADD, BPF_REG_4,
+			eth + XDP_IPV6_HDR_SIZE + XDP_UDP_HDR_SIZE);
+	bpf_jmp_reg(a, BPF_JGT, BPF_REG_4, BPF_REG_3, XDP_LABEL_PASS);
+	bpf_load(a, BPF_B, BPF_REG_5, BPF_REG_2,
+			eth + offsetof(struct ip6_hdr, ip6_nxt));
+	bpf_jmp_imm(a, BPF_JNE, BPF_REG_5, IPPROTO_UDP, XDP_LABEL_PASS);
+	bpf_load(a, BPF_H, BPF_REG_5, BPF_REG_2, eth + XDP_IPV6_HDR_SIZE +
+			offsetof(struct udphdr, dest));
+	bpf_jmp_imm(a, BPF_JA, 0, 0, XDP_LABEL_PORT);
+
+	/* IPv4, unfragmented. */
+	bpf_label(a, XDP_LABEL_IPV4);
+	bpf_mov_reg(a, BPF_REG_4, BPF_REG_2);
+	bpf_alu_imm(a, BPF_ADD, BPF_REG_4, eth + XDP_IPV4_HDR_SIZE);
+	bpf_jmp_reg(a, BPF_JGT, BPF_REG_4, BPF_REG_3, XDP_LABEL_PASS);
+	bpf_load(a, BPF_B, BPF_REG_5, BPF_REG_2,
+			eth + offsetof(struct iphdr, protocol));
+	bpf_jmp_imm(a, BPF_JNE, BPF_REG_5, IPPROTO_UDP, XDP_LABEL_PASS);
+	bpf_load(a, BPF_H, BPF_REG_5, BPF_REG_2,
+			eth + offsetof(struct iphdr, frag_off));
+	bpf_alu_imm(a, BPF_AND, BPF_REG_5, htons(IP_MF | IP_OFFMASK));
+	bpf_jmp_imm(a, BPF_JNE, BPF_REG_5, 0, XDP_LABEL_PASS);
+	bpf_load(a, BPF_B, BPF_REG_5, BPF_REG_2, eth);
+	bpf_alu_imm(a, BPF_AND, BPF_REG_5, 0x0f);
+	bpf_alu_imm(a, BPF_LSH, BPF_REG_5, 2);
+	bpf_jmp_imm(a, BPF_JLT, BPF_REG_5, XDP_IPV4_HDR_SIZE, XDP_LABEL_PASS);
+	bpf_add_reg(a, BPF_REG_2, BPF_REG_5);
+	bpf_mov_reg(a, BPF_REG_4, BPF_REG_2);
+	bpf_alu_imm(a, BPF_ADD, BPF_REG_4, eth + XDP_UDP_HDR_SIZE);
+	bpf_jmp_reg(a, BPF_JGT, BPF_REG_4, BPF_REG_3, XDP_LABEL_PASS);
+	bpf_load(a, BPF_H, BPF_REG_5, BPF_REG_2,
+			eth + offsetof(struct udphdr, dest));
+
+	bpf_label(a, XDP_LABEL_PORT);
+	for (int i = 0; i < iface->n_bindings; i++) {
+		bpf_jmp_imm(a, BPF_JEQ, BPF_REG_5,
+				iface->bindings[i].conn->xdp_port,
+				XDP_LABEL_REDIRECT);
+	}
+	bpf_jmp_imm(a, BPF_JA, 0, 0, XDP_LABEL_PASS);
+
+	/* bpf_redirect_map(map, rx_queue_index, XDP_PASS) */
+	bpf_label(a, XDP_LABEL_REDIRECT);
+	bpf_load(a, BPF_W, BPF_REG_2, BPF_REG_6,
+			offsetof(struct xdp_md, rx_queue_index));
+	bpf_emit(a, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD,
+			0, iface->map_fd, -1);
+	bpf_emit(a, 0, 0, 0, 0, 0, -1);
+	bpf_alu_imm(a, BPF_MOV, BPF_REG_3, XDP_PASS);
+	bpf_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map, -1);
+	bpf_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0, -1);
+
+	bpf_label(a, XDP_LABEL_PASS);
+	bpf_alu_imm(a, BPF_MOV, BPF_REG_0, XDP_PASS);
+	bpf_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0, -1);
+
+	for (int i = 0; i < a->n; i++) {
+		if (a->targets[i] != -1)
+			a->insns[i].off = a->labels[a->targets[i]] - i - 1;
+	}
+}
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Loads the XDP program of an interface and returns its fd. */
+static int load_xdp_prog(const struct xdp_iface *iface)
+{
+	struct bpf_asm a;
+	memset(&a, 0, sizeof(a));
+	assemble_xdp_prog(&a, iface);
+	static char log[65536];
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uintptr_t)a.insns;
+	attr.insn_cnt = a.n;
+	attr.license = (uintptr_t)"GPL";
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	strncpy(attr.prog_name, "udpcan", sizeof(attr.prog_name) - 1);
+	int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd == -1) {
+		warn("%s: failed to load XDP program", iface->ifname);
+		failx("Verifier log:\n%s", log);
+	}
+	free(a.insns);
+	free(a.targets);
+	return fd;
+}
+
+static void map_xdp_ring(int fd, struct xdp_ring *ring,
+		const struct xdp_ring_offset *off, off_t pgoff,
+		size_t desc_size)
+{
+	uint8_t *map = mmap(NULL, off->desc + XDP_RING_SIZE * desc_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, pgoff);
+	if (map == MAP_FAILED)
+		fail("Failed to map AF_XDP ring");
+	own_mapping(map, off->desc + XDP_RING_SIZE * desc_size);
+	ring->producer = (uint32_t *)(map + off->producer);
+	ring->consumer = (uint32_t *)(map + off->consumer);
+	ring->flags = (uint32_t *)(map + off->flags);
+	ring->descs = map + off->desc;
+}
+
+/* Creates an AF_XDP socket and binds it to a queue of an interface. */
+static void open_xdp_socket(struct xdp_socket *xsk)
+{
+	const struct xdp_iface *iface = xsk->iface;
+	xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (xsk->fd == -1)
+		fail("Failed to create AF_XDP socket");
+	own_fd(xsk->fd);
+	size_t umem_size = (size_t)XDP_FRAMES * XDP_FRAME_SIZE;
+	xsk->umem = arena_alloc(umem_size);
+	struct xdp_umem_reg reg = {
+		.addr = (uintptr_t)xsk->umem,
+		.len = umem_size,
+		.chunk_size = XDP_FRAME_SIZE,
+	};
+	int ring_size = XDP_RING_SIZE;
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG,
+				&reg, sizeof(reg)) == -1 ||
+			setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING,
+				&ring_size, sizeof(ring_size)) == -1 ||
+			setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+				&ring_size, sizeof(ring_size)) == -1 ||
+			setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING,
+				&ring_size, sizeof(ring_size)) == -1 ||
+			setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING,
+				&ring_size, sizeof(ring_size)) == -1)
+		fail("Failed to set up AF_XDP socket");
+	struct xdp_mmap_offsets off;
+	socklen_t len = sizeof(off);
+	if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) == -1)
+		fail("XDP_MMAP_OFFSETS");
+	map_xdp_ring(xsk->fd, &xsk->fill, &off.fr, XDP_UMEM_PGOFF_FILL_RING,
+			sizeof(uint64_t));
+	map_xdp_ring(xsk->fd, &xsk->completion, &off.cr,
+			XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t));
+	map_xdp_ring(xsk->fd, &xsk->rx, &off.rx, XDP_PGOFF_RX_RING,
+			sizeof(struct xdp_desc));
+	map_xdp_ring(xsk->fd, &xsk->tx, &off.tx, XDP_PGOFF_TX_RING,
+			sizeof(struct xdp_desc));
+	/* The first half of the frames is for RX, the second for TX. */
+	uint64_t *fill = xsk->fill.descs;
+	for (int i = 0; i < XDP_RING_SIZE; i++)
+		fill[i] = (uint64_t)i * XDP_FRAME_SIZE;
+	__atomic_store_n(xsk->fill.producer, XDP_RING_SIZE, __ATOMIC_RELEASE);
+	for (int i = 0; i < XDP_FRAMES / 2; i++) {
+		xsk->free_frames[i] =
+				(uint64_t)(XDP_FRAMES / 2 + i) * XDP_FRAME_SIZE;
+	}
+	xsk->n_free = XDP_FRAMES / 2;
+	struct sockaddr_xdp addr = {
+		.sxdp_family = AF_XDP,
+		.sxdp_ifindex = iface->ifindex,
+		.sxdp_queue_id = xsk->queue,
+		.sxdp_flags = XDP_USE_NEED_WAKEUP,
+	};
+	if (iface->mode == XDP_MODE_GENERIC)
+		addr.sxdp_flags |= XDP_COPY;
+	if (bind(xsk->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		fail("Failed to bind AF_XDP socket to %s queue %u",
+				iface->ifname, xsk->queue);
+	}
+	uint32_t key = xsk->queue;
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = iface->map_fd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&xsk->fd;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+		fail("Failed to add AF_XDP socket to XSKMAP");
+}
+
+/*
+ * Creates the XSKMAP of an interface and reads the addresses needed to build
+ * packets.
+ */
+static void open_xdp_iface(struct xdp_iface *iface)
+{
+	iface->ifindex = if_nametoindex(iface->ifname);
+	if (iface->ifindex == 0)
+		fail("Unknown interface '%s'", iface->ifname);
+	/* Owned until closed below, in case of failure. */
+	int n_fds = resources->n_fds;
+	int sfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sfd == -1)
+		fail("socket");
+	own_fd(sfd);
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, iface->ifname, sizeof(ifr.ifr_name) - 1);
+	if (ioctl(sfd, SIOCGIFHWADDR, &ifr) == -1)
+		fail("%s: SIOCGIFHWADDR", iface->ifname);
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+		failx("%s: not an Ethernet interface",
+				iface->ifname);
+	memcpy(iface->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	if (ioctl(sfd, SIOCGIFMTU, &ifr) == -1)
+		fail("%s: SIOCGIFMTU", iface->ifname);
+	iface->mtu = ifr.ifr_mtu;
+	close_fds(resources, n_fds);
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(int);
+	attr.max_entries = XDP_MAX_QUEUES;
+	strncpy(attr.map_name, "udpcan_xsks", sizeof(attr.map_name) - 1);
+	iface->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (iface->map_fd == -1)
+		fail("%s: failed to create XSKMAP", iface->ifname);
+	own_fd(iface->map_fd);
+}
+
+/*
+ * Attaches the XDP program to an interface. The program is attached through
+ * a BPF link that goes away with its fd, closed by udpcan_destroy() or on
+ * exit, so it doesn't outlive udpcan.
+ */
+static void attach_xdp_prog(const struct xdp_iface *iface)
+{
+	/* The link holds the program, whose fd is closed below. */
+	int n_fds = resources->n_fds;
+	int prog_fd = load_xdp_prog(iface);
+	own_fd(prog_fd);
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = iface->ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	if (iface->mode == XDP_MODE_NATIVE)
+		attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+	else if (iface->mode == XDP_MODE_GENERIC)
+		attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	int link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (link_fd == -1) {
+		fail("%s: failed to attach XDP program",
+				iface->ifname);
+	}
+	close_fds(resources, n_fds);
+	own_fd(link_fd);
+}
+
+/*
+ * Sets up AF_XDP sockets for connections with the xdp option: one per
+ * interface and queue, shared by the connections that name them. Returns the
+ * number of sockets, whose fds have to be polled, and the sockets in xsks.
+ */
+static int setup_xdp(struct connection *connections, int n_connections,
+		struct xdp_socket ***xsks)
+{
+	struct xdp_iface **ifaces = NULL;
+	int n_ifaces = 0;
+	int n_xsks = 0;
+	*xsks = NULL;
+	for (int i = 0; i < n_connections; i++) {
+		struct connection *conn = &connections[i];
+		const struct config *config = &conn->config;
+		if (!config->xdp_ifname) {
+			if (config->xdp_mode != XDP_MODE_AUTO) {
+				failx("%s: xdp_mode requires xdp",
+						str_config(config));
+			}
+			continue;
+		}
+		if (config->xdp_queue >= XDP_MAX_QUEUES) {
+			failx("%s: xdp queue must be less than %d",
+					str_config(config), XDP_MAX_QUEUES);
+		}
+		struct xdp_iface *iface = NULL;
+		for (int j = 0; j < n_ifaces; j++) {
+			if (strcmp(ifaces[j]->ifname, config->xdp_ifname) == 0)
+				iface = ifaces[j];
+		}
+		if (!iface) {
+			iface = xmalloc(sizeof(*iface));
+			memset(iface, 0, sizeof(*iface));
+			iface->ifname = config->xdp_ifname;
+			iface->mode = config->xdp_mode;
+			ifaces = xrealloc(ifaces, sizeof(*ifaces) *
+					(n_ifaces + 1));
+			ifaces[n_ifaces++] = iface;
+		} else if (iface->mode != config->xdp_mode) {
+			failx("%s: conflicting xdp_mode for %s",
+					str_config(config), iface->ifname);
+		}
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(conn->in_sfd, (struct sockaddr *)&addr,
+				&len) == -1)
+			fail("getsockname");
+		conn->xdp_port = addr.ss_family == AF_INET ?
+				((struct sockaddr_in *)&addr)->sin_port :
+				((struct sockaddr_in6 *)&addr)->sin6_port;
+		iface->bindings = xrealloc(iface->bindings,
+				sizeof(*iface->bindings) *
+				(iface->n_bindings + 1));
+		iface->bindings[iface->n_bindings++] = (struct xdp_binding) {
+			.conn = conn,
+			.family = addr.ss_family,
+		};
+		for (int j = 0; j < n_xsks && !conn->xdp; j++) {
+			if ((*xsks)[j]->iface == iface &&
+					(*xsks)[j]->queue == config->xdp_queue)
+				conn->xdp = (*xsks)[j];
+		}
+		if (!conn->xdp) {
+			struct xdp_socket *xsk = arena_alloc(sizeof(*xsk));
+			xsk->iface = iface;
+			xsk->queue = config->xdp_queue;
+			*xsks = xrealloc(*xsks, sizeof(**xsks) * (n_xsks + 1));
+			(*xsks)[n_xsks++] = xsk;
+			conn->xdp = xsk;
+		}
+		/* Send from the port the kernel would send from. */
+		for (int j = 0; j < conn->n_dests; j++) {
+			struct destination *dest = &conn->dests[j];
+			len = sizeof(addr);
+			if (getsockname(dest->sfd, (struct sockaddr *)&addr,
+					&len) == -1)
+				fail("getsockname");
+			dest->src_port = addr.ss_family == AF_INET ?
+				((struct sockaddr_in *)&addr)->sin_port :
+				((struct sockaddr_in6 *)&addr)->sin6_port;
+		}
+	}
+	for (int i = 0; i < n_ifaces; i++)
+		open_xdp_iface(ifaces[i]);
+	for (int i = 0; i < n_xsks; i++)
+		open_xdp_socket((*xsks)[i]);
+	for (int i = 0; i < n_ifaces; i++)
+		attach_xdp_prog(ifaces[i]);
+	free(ifaces);
+	return n_xsks;
+}
+
+/* Cyclic frame scheduled in a timer wheel. */
+struct cyclic_timer {
+	struct wheel_timer timer;
+	struct connection *conn;
+	const struct cyclic_spec *spec;
+};
+
+/* Sends a cyclic frame. */
+static void fire_cyclic_timer(struct timer_wheel *wheel,
+		struct wheel_timer *timer)
+{
+	struct cyclic_timer *cyclic = container_of(timer, struct cyclic_timer,
+			timer);
+	struct connection *conn = cyclic->conn;
+	const struct cyclic_spec *spec = cyclic->spec;
+	int rc;
+	if (spec->to_udp && conn->auth) {
+		rc = send_auth_frames(conn, &spec->frame, 1);
+	} else if (spec->to_udp) {
+		size_t size;
+		struct packed_can_frame packed_frame;
+		pack_can_frame(&spec->frame, &packed_frame, &size);
+		rc = send_udp(conn, spec->frame.can_id, &packed_frame, size);
+	} else if (conn->bus_off) {
+		conn->can_err_stats.dropped_bus_off++;
+		return;
+	} else {
+		/*
+		 * Pass the ideal emission time so that a frame scheduled with
+		 * SO_TXTIME leaves the interface without wakeup jitter.
+		 */
+		uint64_t due_ns = timer_wheel_due_ns(wheel, timer);
+		uint64_t realtime_ns = now_realtime_ns() - (now_ns() - due_ns);
+		rc = send_can_frame(conn, &spec->frame, realtime_ns);
+	}
+	if (rc == -1)
+		conn->cyclic_failed++;
+	else
+		conn->cyclic_sent++;
+}
+
+/* Schedules cyclic frames of a connection in a timer wheel. */
+static void setup_cyclic_timers(struct timer_wheel *wheel,
+		struct connection *conn)
+{
+	int n = conn->config.n_cyclic;
+	if (n == 0)
+		return;
+	struct cyclic_timer *timers = arena_alloc(sizeof(*timers) * n);
+	for (int i = 0; i < n; i++) {
+		struct cyclic_timer *timer = &timers[i];
+		timer->conn = conn;
+		timer->spec = &conn->config.cyclic[i];
+		timer->timer.fire = fire_cyclic_timer;
+		/* Spread the first emissions to avoid bursts. */
+		uint32_t period = timer->spec->period_ms;
+		timer_wheel_add(wheel, &timer->timer,
+				wheel->n_timers % period, period);
+	}
+}
+
+/* Weight of a new sample in the moving averages of struct batch_ctl. */
+#define BATCH_CTL_EWMA_SHIFT 3
+/*
+ * Min number of reads of can_sfd a pause must save: it costs two epoll_ctl()
+ * calls, so it must save more than that to make forwarding cheaper.
+ */
+#define BATCH_CTL_MIN_SAVED_READS 4
+
+static void batch_ctl_watch(struct batch_ctl *ctl, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.u64 = ctl->epoll_data,
+	};
+	if (epoll_ctl(ctl->epfd, EPOLL_CTL_MOD, ctl->conn->can_sfd, &ev) == -1)
+		fail("epoll_ctl");
+}
+
+static void fire_batch_ctl_timer(struct timer_wheel *wheel,
+		struct wheel_timer *timer)
+{
+	(void)wheel;
+	batch_ctl_watch(container_of(timer, struct batch_ctl, timer), EPOLLIN);
+}
+
+static void batch_ctl_average(uint64_t *avg, uint64_t sample)
+{
+	*avg = *avg - (*avg >> BATCH_CTL_EWMA_SHIFT) +
+			(sample >> BATCH_CTL_EWMA_SHIFT);
+}
+
+/*
+ * Adapts the batch size of a connection after can_to_udp() read n frames in
+ * handler_ns, and pauses reading can_sfd if that lets frames be batched within
+ * the latency bound, see struct batch_ctl.
+ */
+static void batch_ctl_update(struct batch_ctl *ctl, int n, uint64_t now,
+		uint64_t handler_ns)
+{
+	struct connection *conn = ctl->conn;
+	if (n <= 0)
+		return;
+	/* Idle time says nothing about the rate of the next burst. */
+	uint64_t interval_ns = (now - ctl->read_ns) / n;
+	if (interval_ns > ctl->latency_ns)
+		interval_ns = ctl->latency_ns;
+	ctl->read_ns = now;
+	batch_ctl_average(&ctl->interval_ns, interval_ns);
+	batch_ctl_average(&ctl->cost_ns, handler_ns / n);
+	uint64_t depth = ctl->depth;
+	batch_ctl_average(&depth, (uint64_t)n << 4);
+	ctl->depth = depth;
+	ctl->pause_ns = 0;
+	if (handler_ns > ctl->latency_ns) {
+		if (conn->batch_size > 1) {
+			conn->batch_size /= 2;
+			ctl->shrunk++;
+		}
+	} else if ((uint32_t)n == conn->batch_size) {
+		/* Frames queue up by themselves, read again right away. */
+		if (conn->batch_size < conn->config.batch) {
+			conn->batch_size++;
+			ctl->grown++;
+		}
+		return;
+	}
+	/*
+	 * Pause for as long as it takes to fill a batch, leaving time to
+	 * handle it within the latency bound. The timer wheel releases the
+	 * pause at the first tick after it is due, so a pause must be longer
+	 * than a tick and is scheduled a tick early.
+	 */
+	uint64_t fill_ns = ctl->interval_ns * conn->batch_size;
+	uint64_t handle_ns = ctl->cost_ns * conn->batch_size;
+	if (handle_ns + TIMER_WHEEL_TICK_NS >= ctl->latency_ns)
+		return;
+	uint64_t pause_ns = fill_ns;
+	if (pause_ns > ctl->latency_ns - handle_ns)
+		pause_ns = ctl->latency_ns - handle_ns;
+	/* About pause_ns / interval_ns reads become one. */
+	if (pause_ns <= TIMER_WHEEL_TICK_NS || pause_ns <
+			(BATCH_CTL_MIN_SAVED_READS + 1) * ctl->interval_ns)
+		return;
+	ctl->pause_ns = pause_ns;
+	ctl->pauses++;
+	batch_ctl_watch(ctl, 0);
+	timer_wheel_add_at(ctl->wheel, &ctl->timer,
+			now + pause_ns - TIMER_WHEEL_TICK_NS);
+}
+
+/*
+ * Sets up adaptive batching for a connection whose can_sfd is registered with
+ * epfd with epoll data epoll_data.
+ */
+static void setup_batch_ctl(struct timer_wheel *wheel, int epfd,
+		uint64_t epoll_data, struct connection *conn)
+{
+	if (conn->config.batch_latency_us == 0)
+		return;
+	struct batch_ctl *ctl = arena_alloc(sizeof(*ctl));
+	ctl->timer.fire = fire_batch_ctl_timer;
+	ctl->conn = conn;
+	ctl->wheel = wheel;
+	ctl->epfd = epfd;
+	ctl->epoll_data = epoll_data;
+	ctl->latency_ns = conn->config.batch_latency_us * 1000ULL;
+	ctl->read_ns = now_ns();
+	/* Assume a slow bus until frames say otherwise. */
+	ctl->interval_ns = ctl->latency_ns;
+	ctl->depth = 1 << 4;
+	conn->batch_ctl = ctl;
+}
+
+/* Prints connection statistics to stdout. */
+static void print_stats(const struct connection *conn)
+{
+	const struct can_error_stats *stats = &conn->can_err_stats;
+	printf("%s: CAN errors: bus-off %llu, error-passive %llu, "
+			"error-warning %llu, arbitration-lost %llu, "
+			"tx-timeout %llu, bus-error %llu, overflow %llu, "
+			"restarted %llu\n", str_config(&conn->config),
+			(unsigned long long)stats->bus_off,
+			(unsigned long long)stats->error_passive,
+			(unsigned long long)stats->error_warning,
+			(unsigned long long)stats->arbitration_lost,
+			(unsigned long long)stats->tx_timeout,
+			(unsigned long long)stats->bus_error,
+			(unsigned long long)stats->overflow,
+			(unsigned long long)stats->restarted);
+	printf("%s: CAN bus-off: %s, recoveries %llu, "
+			"total %llu ms, max %llu ms, dropped %llu\n",
+			str_config(&conn->config),
+			conn->bus_off ? "yes" : "no",
+			(unsigned long long)stats->recoveries,
+			(unsigned long long)(stats->bus_off_total_ns / 1000000),
+			(unsigned long long)(stats->bus_off_max_ns / 1000000),
+			(unsigned long long)stats->dropped_bus_off);
+	if (conn->config.txtime) {
+		printf("%s: UDP->CAN scheduled: missed %llu, errors %llu\n",
+				str_config(&conn->config),
+				(unsigned long long)conn->txtime_missed,
+				(unsigned long long)conn->txtime_errors);
+	}
+	if (conn->config.n_cyclic > 0) {
+		printf("%s: cyclic frames: %d, sent %llu, failed %llu\n",
+				str_config(&conn->config), conn->config.n_cyclic,
+				(unsigned long long)conn->cyclic_sent,
+				(unsigned long long)conn->cyclic_failed);
+	}
+	for (int i = 0; i < conn->n_dests; i++) {
+		const struct destination *dest = &conn->dests[i];
+		const struct peer_state *peer = &dest->peer;
+		printf("%s: peer %s:%s: %s, sent %llu, deaths %llu, "
+				"dead total %llu ms, heartbeats %llu, "
+				"probes %llu\n", str_config(&conn->config),
+				dest->host, dest->port,
+				peer->dead ? "dead" : "alive",
+				(unsigned long long)dest->sent,
+				(unsigned long long)peer->deaths,
+				(unsigned long long)(peer->dead_total_ns /
+						     1000000),
+				(unsigned long long)peer->heartbeats_sent,
+				(unsigned long long)peer->probes_sent);
+	}
+	printf("%s: CAN->UDP suppressed: %llu\n", str_config(&conn->config),
+			(unsigned long long)conn->suppressed);
+	for (int i = 0; i < conn->config.n_can_prio; i++) {
+		const struct can_prio_class *class = &conn->config.can_prio[i];
+		printf("%s: can_prio %x-%x: priority %d, sent %llu\n",
+				str_config(&conn->config), class->ids.first,
+				class->ids.last, class->priority,
+				(unsigned long long)conn->can_prio->sent[i]);
+	}
+	for (int i = 0; i < conn->config.n_qos; i++) {
+		const struct qos_class *class = &conn->config.qos[i];
+		printf("%s: qos %x-%x: DSCP %u, priority %d, sent %llu\n",
+				str_config(&conn->config), class->ids.first,
+				class->ids.last, class->dscp,
+				conn->qos->no_priority ? -1 : class->priority,
+				(unsigned long long)conn->qos->sent[i]);
+	}
+	if (conn->batch_ctl) {
+		const struct batch_ctl *ctl = conn->batch_ctl;
+		printf("%s: CAN->UDP batching: size %u (max %u), pause %.1f ms, "
+				"%.0f frames/s, %.1f frames/read, "
+				"%llu ns/frame, grown %llu, shrunk %llu, "
+				"pauses %llu\n", str_config(&conn->config),
+				conn->batch_size, conn->config.batch,
+				ctl->pause_ns / 1e6, 1e9 / (ctl->interval_ns ?: 1),
+				ctl->depth / 16.0,
+				(unsigned long long)ctl->cost_ns,
+				(unsigned long long)ctl->grown,
+				(unsigned long long)ctl->shrunk,
+				(unsigned long long)ctl->pauses);
+	}
+	if (conn->allowlist) {
+		const struct allowlist *list = conn->allowlist;
+		for (int i = 0; i < ALLOWLIST_SOURCES; i++) {
+			const struct allowlist_source *source =
+				&list->sources[i];
+			if (!source->used)
+				continue;
+			char host[INET6_ADDRSTRLEN];
+			inet_ntop(AF_INET6, &source->addr, host, sizeof(host));
+			printf("%s: source %s: accepted %llu, dropped %llu\n",
+					str_config(&conn->config), host,
+					(unsigned long long)source->accepted,
+					(unsigned long long)source->dropped);
+		}
+		printf("%s: untracked sources: accepted %llu, dropped %llu\n",
+				str_config(&conn->config),
+				(unsigned long long)list->untracked_accepted,
+				(unsigned long long)list->untracked_dropped);
+	}
+	if (conn->auth) {
+		const struct auth_state *auth = conn->auth;
+		printf("%s: auth sent: datagrams %llu, frames %llu, "
+				"MAC %llu ns/datagram, %llu ns/frame\n",
+				str_config(&conn->config),
+				(unsigned long long)auth->tx_datagrams,
+				(unsigned long long)auth->tx_frames,
+				(unsigned long long)(auth->tx_mac_ns /
+					(auth->tx_datagrams ?: 1)),
+				(unsigned long long)(auth->tx_mac_ns /
+					(auth->tx_frames ?: 1)));
+		printf("%s: auth received: datagrams %llu, frames %llu, "
+				"MAC %llu ns/datagram, %llu ns/frame, "
+				"bad MAC %llu, replayed %llu, skewed %llu, "
+				"malformed %llu, senders evicted %llu\n",
+				str_config(&conn->config),
+				(unsigned long long)auth->rx_datagrams,
+				(unsigned long long)auth->rx_frames,
+				(unsigned long long)(auth->rx_mac_ns /
+					(auth->rx_datagrams ?: 1)),
+				(unsigned long long)(auth->rx_mac_ns /
+					(auth->rx_frames ?: 1)),
+				(unsigned long long)auth->bad_mac,
+				(unsigned long long)auth->replayed,
+				(unsigned long long)auth->skewed,
+				(unsigned long long)auth->malformed,
+				(unsigned long long)auth->evicted);
+	}
+	if (conn->impair) {
+		const struct impairment *imp = conn->impair;
+		const struct impair_path *paths[] = {
+			imp->tx_enabled ? &imp->tx : NULL,
+			imp->udp_to_can ? &imp->rx : NULL,
+		};
+		for (int i = 0; i < 2; i++) {
+			const struct impair_path *path = paths[i];
+			if (!path)
+				continue;
+			printf("%s: impairment %s: passed %llu, lost %llu, "
+					"duplicated %llu, reordered %llu, "
+					"overflow %llu\n",
+					str_config(&conn->config),
+					path->rx ? "rx" : "tx",
+					(unsigned long long)path->passed,
+					(unsigned long long)path->lost,
+					(unsigned long long)path->duplicated,
+					(unsigned long long)path->reordered,
+					(unsigned long long)path->overflow);
+		}
+	}
+	print_histogram(str_config(&conn->config), "handler duration",
+			&conn->handler_time);
+	if (conn->tx_stamps) {
+		const struct tx_stamp_state *state = conn->tx_stamps;
+		print_histogram(str_config(&conn->config),
+				"UDP->CAN latency in udpcan", &state->udpcan);
+		print_histogram(str_config(&conn->config),
+				"UDP->CAN latency in qdisc", &state->qdisc);
+		print_histogram(str_config(&conn->config),
+				"UDP->CAN latency total", &state->total);
+		if (state->unmatched > 0) {
+			printf("%s: UDP->CAN: %llu unmatched TX timestamps\n",
+					str_config(&conn->config),
+					(unsigned long long)state->unmatched);
+		}
+	}
+}
+
+/* Prints statistics of an AF_XDP socket to stdout. */
+static void print_xdp_stats(const struct xdp_socket *xsk)
+{
+	struct xdp_statistics stats;
+	memset(&stats, 0, sizeof(stats));
+	socklen_t len = sizeof(stats);
+	getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, &stats, &len);
+	printf("udpcan: XDP %s queue %u: received %llu, sent %llu, "
+			"sent via kernel %llu, malformed %llu, "
+			"unknown port %llu, dropped by kernel %llu, "
+			"RX ring full %llu\n", xsk->iface->ifname, xsk->queue,
+			(unsigned long long)xsk->received,
+			(unsigned long long)xsk->sent,
+			(unsigned long long)xsk->via_kernel,
+			(unsigned long long)xsk->malformed,
+			(unsigned long long)xsk->unknown_port,
+			(unsigned long long)stats.rx_dropped,
+			(unsigned long long)stats.rx_ring_full);
+}
+
+/* Default max time an event loop iteration may spend in handlers. */
+#define LOOP_DEFAULT_BUDGET_US 10000
+/* Min interval between warnings about iterations over budget. */
+#define LOOP_WARN_INTERVAL_NS 1000000000ULL
+/* Max time events of a low priority connection are deferred. */
+#define LOOP_MAX_DEFER_NS 100000000ULL
+
+static const char *const prio_class_names[PRIO_CLASSES] = {
+	[PRIO_HIGH] = "high",
+	[PRIO_NORMAL] = "normal",
+	[PRIO_LOW] = "low",
+};
+
+/* Self-monitoring of the event loop. */
+struct loop_stats {
+	/* Max time an iteration may spend in handlers, 0 if unlimited. */
+	uint64_t budget_ns;
+	/* Time spent waiting for events, per iteration. */
+	struct histogram idle;
+	/* Time spent in handlers, per iteration. */
+	struct histogram busy;
+	/* Time spent firing timers, per timerfd expiration. */
+	struct histogram timers;
+	uint64_t iterations;
+	/* Number of handlers called, in total and max per iteration. */
+	uint64_t events;
+	uint64_t max_events;
+	/* Number of iterations over budget. */
+	uint64_t over_budget;
+	/*
+	 * Time from the end of the wait in which an event was first seen to the
+	 * start of its handler, per priority class.
+	 */
+	struct histogram dispatch_delay[PRIO_CLASSES];
+	/*
+	 * Number of low priority events deferred to the next iteration, and
+	 * handled over budget because they had been deferred for too long.
+	 */
+	uint64_t deferred;
+	uint64_t deferred_too_long;
+	/* Time of the last warning and iterations over budget since. */
+	uint64_t warned_ns;
+	uint64_t unwarned;
+};
+
+/*
+ * Accounts an event loop iteration. slowest is the connection whose handler
+ * took the longest, NULL if it was the timer wheel.
+ */
+static void loop_iteration_done(struct loop_stats *loop, uint64_t busy_ns,
+		int events, const struct connection *slowest,
+		uint64_t slowest_ns)
+{
+	histogram_add(&loop->busy, busy_ns);
+	loop->iterations++;
+	loop->events += events;
+	if ((uint64_t)events > loop->max_events)
+		loop->max_events = events;
+	if (loop->budget_ns == 0 || busy_ns <= loop->budget_ns)
+		return;
+	loop->over_budget++;
+	uint64_t now = now_ns();
+	if (now - loop->warned_ns < LOOP_WARN_INTERVAL_NS) {
+		loop->unwarned++;
+		return;
+	}
+	printf("udpcan: event loop iteration took %.1f ms, over budget "
+			"%.1f ms: %d events, slowest %s %.1f ms",
+			busy_ns / 1e6, loop->budget_ns / 1e6, events,
+			slowest ? str_config(&slowest->config) : "timers",
+			slowest_ns / 1e6);
+	if (loop->unwarned > 0) {
+		printf(" (%llu more iterations over budget)",
+				(unsigned long long)loop->unwarned);
+	}
+	printf("\n");
+	loop->warned_ns = now;
+	loop->unwarned = 0;
+}
+
+static void print_loop_stats(const struct loop_stats *loop,
+		const struct arena *arena)
+{
+	printf("udpcan: event loop: iterations %llu, events %llu "
+			"(max %llu per iteration), over budget %llu\n",
+			(unsigned long long)loop->iterations,
+			(unsigned long long)loop->events,
+			(unsigned long long)loop->max_events,
+			(unsigned long long)loop->over_budget);
+	print_histogram("udpcan", "event loop idle", &loop->idle);
+	print_histogram("udpcan", "event loop busy", &loop->busy);
+	print_histogram("udpcan", "timers", &loop->timers);
+	for (int i = 0; i < PRIO_CLASSES; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s priority dispatch delay",
+				prio_class_names[i]);
+		print_histogram("udpcan", name, &loop->dispatch_delay[i]);
+	}
+	printf("udpcan: low priority: %llu events deferred, %llu handled "
+			"over budget after %llu ms\n",
+			(unsigned long long)loop->deferred,
+			(unsigned long long)loop->deferred_too_long,
+			LOOP_MAX_DEFER_NS / 1000000);
+	printf("udpcan: memory: arena %zu KiB used, %zu KiB mapped, "
+			"%zu KiB on huge pages\n", arena->used / 1024,
+			arena->mapped / 1024, arena->huge_mapped / 1024);
+}
+
+/* Max number of events handled per event loop iteration. */
+#define LOOP_MAX_EVENTS 256
+
+/*
+ * Kinds of fds the event loop waits on. The epoll data of an fd is the index
+ * of its connection or AF_XDP socket shifted by LOOP_FD_KIND_BITS, or'ed with
+ * its kind, so that events are dispatched without searching.
+ */
+enum loop_fd_kind {
+	LOOP_FD_CAN,
+	LOOP_FD_UDP,
+	LOOP_FD_TIMERS,
+	LOOP_FD_XDP,
+};
+#define LOOP_FD_KIND_BITS 2
+#define LOOP_FD_KIND_MASK ((1 << LOOP_FD_KIND_BITS) - 1)
+
+static uint64_t loop_fd_data(enum loop_fd_kind kind, int index)
+{
+	return (uint64_t)index << LOOP_FD_KIND_BITS | kind;
+}
+
+/* Library API, see udpcan.h. */
+
+struct udpcan {
+	/* Also holds the memory of the struct udpcan. */
+	struct resources resources;
+	struct connection *connections;
+	int n_connections;
+	int max_connections;
+	/* Buffers of can_to_udp(), see setup_can_batch(). */
+	struct can_batch *can_batch;
+	struct xdp_socket **xsks;
+	int n_xsks;
+	struct timer_wheel *timer_wheel;
+	/*
+	 * Epoll fd of the event loop. It waits on one epoll fd per priority
+	 * class, which wait on the fds of the class.
+	 */
+	int epfd;
+	int prio_epfds[PRIO_CLASSES];
+	/* Buffer of events of a priority class. */
+	struct epoll_event *events;
+	struct loop_stats loop;
+	bool started;
+};
+
+/* Adds an fd to the event loop in a priority class. */
+static void loop_add_fd(struct udpcan *udpcan, int fd,
+		enum loop_fd_kind kind, int index, enum prio_class prio)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u64 = loop_fd_data(kind, index),
+	};
+	if (epoll_ctl(udpcan->prio_epfds[prio], EPOLL_CTL_ADD, fd, &ev) == -1)
+		fail("epoll_ctl");
+}
+
+/*
+ * Makes setup functions allocate from and register resources with res, and
+ * makes their errors jump to catch, until setup_done().
+ */
+static void setup_begin(struct resources *res, jmp_buf *catch)
+{
+	resources = res;
+	fail_catch = catch;
+}
+
+static void setup_done(void)
+{
+	resources = NULL;
+	fail_catch = NULL;
+}
+
+/* State of the resources of an instance that a failed setup is undone to. */
+struct resources_mark {
+	struct arena arena;
+	int n_maps;
+	int n_fds;
+};
+
+static struct resources_mark mark_resources(const struct resources *res)
+{
+	return (struct resources_mark) {
+		.arena = res->arena,
+		.n_maps = res->n_maps,
+		.n_fds = res->n_fds,
+	};
+}
+
+/*
+ * Undoes the setup of an instance since a mark: closes the fds opened and
+ * unmaps the memory mapped since, and returns the arena allocations made
+ * since to the arena, zeroed again.
+ */
+static void rewind_resources(struct resources *res,
+		const struct resources_mark *mark)
+{
+	const struct arena *arena = &mark->arena;
+	close_fds(res, mark->n_fds);
+	while (res->n_maps > mark->n_maps) {
+		const struct mapping *map = &res->maps[--res->n_maps];
+		munmap(map->addr, map->size);
+	}
+	if (arena->left > 0) {
+		/* The rest of the chunk is unused if a new one was mapped. */
+		bool same_chunk = res->arena.next >= arena->next &&
+				res->arena.next <= arena->next + arena->left;
+		memset(arena->next, 0, same_chunk ?
+				arena->left - res->arena.left : arena->left);
+	}
+	res->arena = *arena;
+}
+
+/* Closes the fds and unmaps the memory of an instance. */
+static void release_resources(struct resources *res)
+{
+	/* res may be in the arena. */
+	struct resources copy = *res;
+	close_fds(&copy, 0);
+	for (int i = 0; i < copy.n_maps; i++)
+		munmap(copy.maps[i].addr, copy.maps[i].size);
+	free(copy.maps);
+	free(copy.fds);
+}
+
+struct udpcan *udpcan_create(int max_bridges, unsigned flags)
+{
+	/*
+	 * The struct udpcan is allocated from its own arena. Static, as it is
+	 * read after a failure.
+	 */
+	static struct resources res;
+	res = (struct resources) {
+		.arena.huge = flags & UDPCAN_HUGE_PAGES,
+	};
+	jmp_buf catch;
+	if (setjmp(catch)) {
+		setup_done();
+		release_resources(&res);
+		return NULL;
+	}
+	setup_begin(&res, &catch);
+	struct udpcan *udpcan = arena_alloc(sizeof(*udpcan));
+	udpcan->connections = arena_alloc(
+			sizeof(*udpcan->connections) * max_bridges);
+	setup_done();
+	udpcan->resources = res;
+	udpcan->max_connections = max_bridges;
+	udpcan->loop.budget_ns = LOOP_DEFAULT_BUDGET_US * 1000ULL;
+	return udpcan;
+}
+
+void udpcan_set_budget(struct udpcan *udpcan, uint64_t budget_us)
+{
+	udpcan->loop.budget_ns = budget_us * 1000;
+}
+
+struct udpcan_bridge *udpcan_add_bridge(struct udpcan *udpcan,
+		const char *spec)
+{
+	if (udpcan->started) {
+		warnx("%s: udpcan already started", spec);
+		return NULL;
+	}
+	if (udpcan->n_connections == udpcan->max_connections) {
+		warnx("%s: too many bridges", spec);
+		return NULL;
+	}
+	struct connection *conn =
+			&udpcan->connections[udpcan->n_connections];
+	/* Resources of the bridge are released if it can't be set up. */
+	struct resources_mark mark = mark_resources(&udpcan->resources);
+	struct can_batch *can_batch = udpcan->can_batch;
+	jmp_buf catch;
+	if (setjmp(catch)) {
+		setup_done();
+		free_connection(conn);
+		memset(conn, 0, sizeof(*conn));
+		rewind_resources(&udpcan->resources, &mark);
+		udpcan->can_batch = can_batch;
+		return NULL;
+	}
+	setup_begin(&udpcan->resources, &catch);
+	conn->id = udpcan->n_connections;
+	parse_config(spec, &conn->config);
+	setup_connection(conn, &udpcan->can_batch);
+	setup_done();
+	udpcan->n_connections++;
+	return conn_bridge(conn);
+}
+
+void udpcan_set_frame_cb(struct udpcan_bridge *bridge, udpcan_frame_cb cb,
+		void *arg)
+{
+	struct connection *conn = bridge_conn(bridge);
+	conn->frame_cb = cb;
+	conn->frame_cb_arg = arg;
+	if (conn->started)
+		specialize_handlers(conn);
+}
+
+void udpcan_set_batch_cb(struct udpcan_bridge *bridge, udpcan_batch_cb cb,
+		void *arg)
+{
+	struct connection *conn = bridge_conn(bridge);
+	conn->batch_cb = cb;
+	conn->batch_cb_arg = arg;
+	if (conn->started)
+		specialize_handlers(conn);
+}
+
+int udpcan_send(struct udpcan_bridge *bridge, const struct can_frame *frame)
+{
+	struct connection *conn = bridge_conn(bridge);
+	if (conn->config.can_proto != CAN_PROTO_RAW) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (conn->auth)
+		return send_auth_frames(conn, frame, 1);
+	size_t size;
+	struct packed_can_frame packed_frame;
+	pack_can_frame(frame, &packed_frame, &size);
+	return send_udp(conn, frame->can_id, &packed_frame, size) == -1 ?
+			-1 : 0;
+}
+
+const char *udpcan_bridge_name(const struct udpcan_bridge *bridge)
+{
+	return str_config(&((const struct connection *)bridge)->config);
+}
+
+int udpcan_start(struct udpcan *udpcan)
+{
+	struct connection *connections = udpcan->connections;
+	int n_connections = udpcan->n_connections;
+	if (udpcan->started) {
+		warnx("udpcan already started");
+		return -1;
+	}
+	/* What was set up is released by udpcan_destroy(). */
+	jmp_buf catch;
+	if (setjmp(catch)) {
+		setup_done();
+		return -1;
+	}
+	setup_begin(&udpcan->resources, &catch);
+	resolve_destinations(connections, n_connections);
+	udpcan->n_xsks = setup_xdp(connections, n_connections, &udpcan->xsks);
+	udpcan->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (udpcan->epfd == -1)
+		fail("epoll_create1");
+	own_fd(udpcan->epfd);
+	for (int i = 0; i < PRIO_CLASSES; i++) {
+		udpcan->prio_epfds[i] = epoll_create1(EPOLL_CLOEXEC);
+		if (udpcan->prio_epfds[i] == -1)
+			fail("epoll_create1");
+		own_fd(udpcan->prio_epfds[i]);
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.u64 = i,
+		};
+		if (epoll_ctl(udpcan->epfd, EPOLL_CTL_ADD,
+				udpcan->prio_epfds[i], &ev) == -1)
+			fail("epoll_ctl");
+	}
+	udpcan->events = arena_alloc(sizeof(*udpcan->events) *
+			LOOP_MAX_EVENTS);
+	for (int i = 0; i < n_connections; i++) {
+		enum prio_class prio = connections[i].config.prio;
+		loop_add_fd(udpcan, connections[i].can_sfd, LOOP_FD_CAN, i,
+				prio);
+		loop_add_fd(udpcan, connections[i].in_sfd, LOOP_FD_UDP, i,
+				prio);
+	}
+	/* AF_XDP sockets may serve connections of any class. */
+	for (int i = 0; i < udpcan->n_xsks; i++) {
+		loop_add_fd(udpcan, udpcan->xsks[i]->fd, LOOP_FD_XDP, i,
+				PRIO_NORMAL);
+	}
+	struct timer_wheel *timer_wheel = timer_wheel_create();
+	for (int i = 0; i < n_connections; i++) {
+		setup_cyclic_timers(timer_wheel, &connections[i]);
+		setup_heartbeat_timers(timer_wheel, &connections[i]);
+		setup_impairment(timer_wheel, &connections[i]);
+		setup_batch_ctl(timer_wheel,
+				udpcan->prio_epfds[connections[i].config.prio],
+				loop_fd_data(LOOP_FD_CAN, i), &connections[i]);
+		specialize_handlers(&connections[i]);
+		connections[i].started = true;
+	}
+	timer_wheel_arm(timer_wheel);
+	/* Timers drive heartbeats and cyclic frames, which must be punctual. */
+	loop_add_fd(udpcan, timer_wheel->tfd, LOOP_FD_TIMERS, 0, PRIO_HIGH);
+	udpcan->timer_wheel = timer_wheel;
+	setup_done();
+	udpcan->started = true;
+#ifdef UDPCAN_PROFILE
+	prof_init();
+#endif
+	/* From here on, all memory comes from the arena. */
+	HEAP_LOCK();
+	return 0;
+}
+
+int udpcan_fd(struct udpcan *udpcan)
+{
+	return udpcan->epfd;
+}
+
+/*
+ * Handles the ready events of a priority class. Once the iteration is over
+ * budget, events of the low priority class are deferred to the next iteration,
+ * unless they have been deferred for LOOP_MAX_DEFER_NS already. Returns the
+ * number of events handled and updates handler_start_ns and the slowest
+ * handler as in udpcan_poll().
+ */
+static int dispatch_prio_class(struct udpcan *udpcan, enum prio_class prio,
+		uint64_t busy_start_ns, uint64_t *handler_start_ns,
+		const struct connection **slowest, uint64_t *slowest_ns)
+{
+	struct connection *connections = udpcan->connections;
+	struct epoll_event *events = udpcan->events;
+	struct loop_stats *loop = &udpcan->loop;
+	int n_events = epoll_wait(udpcan->prio_epfds[prio], events,
+			LOOP_MAX_EVENTS, 0);
+	int handled = 0;
+	for (int i = 0; i < n_events; i++) {
+		uint32_t revents = events[i].events;
+		int index = events[i].data.u64 >> LOOP_FD_KIND_BITS;
+		enum loop_fd_kind kind = events[i].data.u64 & LOOP_FD_KIND_MASK;
+		uint64_t start_ns = *handler_start_ns;
+		uint64_t ready_ns = busy_start_ns;
+		if (kind == LOOP_FD_CAN || kind == LOOP_FD_UDP) {
+			uint64_t *deferred_since_ns =
+				&connections[index].deferred_since_ns[kind];
+			if (prio == PRIO_LOW && loop->budget_ns != 0 &&
+					start_ns - busy_start_ns >
+					loop->budget_ns) {
+				if (*deferred_since_ns == 0)
+					*deferred_since_ns = start_ns;
+				if (start_ns - *deferred_since_ns <
+						LOOP_MAX_DEFER_NS) {
+					loop->deferred++;
+					continue;
+				}
+				loop->deferred_too_long++;
+			}
+			if (*deferred_since_ns != 0)
+				ready_ns = *deferred_since_ns;
+			*deferred_since_ns = 0;
+		}
+		histogram_add(&loop->dispatch_delay[prio], start_ns - ready_ns);
+		handled++;
+		PROF_BEGIN();
+		if (kind == LOOP_FD_TIMERS) {
+			timer_wheel_run(udpcan->timer_wheel);
+			PROF_MARK(PROF_TIMERS);
+			uint64_t now = now_ns();
+			uint64_t timers_ns = now - start_ns;
+			histogram_add(&loop->timers, timers_ns);
+			if (timers_ns > *slowest_ns) {
+				*slowest = NULL;
+				*slowest_ns = timers_ns;
+			}
+			*handler_start_ns = now;
+			continue;
+		}
+		if (kind == LOOP_FD_XDP) {
+			xdp_receive(udpcan->xsks[index]);
+			PROF_MARK(PROF_OTHER);
+			*handler_start_ns = now_ns();
+			continue;
+		}
+		struct connection *conn = &connections[index];
+		if (kind == LOOP_FD_CAN) {
+			if ((revents & EPOLLERR) &&
+					(conn->tx_stamps || conn->config.txtime))
+				read_can_errqueue(conn);
+			if (revents & EPOLLIN)
+				conn->can_to_udp(conn);
+		} else {
+			/* Refusals of packets sent from in_sfd. */
+			if (revents & EPOLLERR)
+				read_udp_errqueue(conn);
+			if (revents & EPOLLIN)
+				conn->udp_to_can(conn);
+		}
+		PROF_MARK(PROF_OTHER);
+		uint64_t now = now_ns();
+		uint64_t handler_ns = now - start_ns;
+		if (kind == LOOP_FD_CAN && (revents & EPOLLIN) &&
+				conn->batch_ctl) {
+			batch_ctl_update(conn->batch_ctl, conn->batch_read,
+					now, handler_ns);
+		}
+		histogram_add(&conn->handler_time, handler_ns);
+		if (handler_ns > *slowest_ns) {
+			*slowest = conn;
+			*slowest_ns = handler_ns;
+		}
+		*handler_start_ns = now;
+	}
+	return handled;
+}
+
+int udpcan_poll(struct udpcan *udpcan, int timeout_ms,
+		const sigset_t *sigmask)
+{
+	struct loop_stats *loop = &udpcan->loop;
+	struct epoll_event ready[PRIO_CLASSES];
+	uint64_t poll_start_ns = now_ns();
+	int n_ready = epoll_pwait(udpcan->epfd, ready, PRIO_CLASSES,
+			timeout_ms, sigmask);
+	if (n_ready == -1)
+		return -1;
+	uint64_t busy_start_ns = now_ns();
+	histogram_add(&loop->idle, busy_start_ns - poll_start_ns);
+	bool prio_ready[PRIO_CLASSES] = { false };
+	for (int i = 0; i < n_ready; i++)
+		prio_ready[ready[i].data.u64] = true;
+	/*
+	 * Each handler is timed from the end of the previous one, which saves
+	 * a clock read per handler.
+	 */
+	uint64_t handler_start_ns = busy_start_ns;
+	const struct connection *slowest = NULL;
+	uint64_t slowest_ns = 0;
+	int events = 0;
+	/* Classes are serviced in order of priority. */
+	for (int prio = 0; prio < PRIO_CLASSES; prio++) {
+		if (!prio_ready[prio])
+			continue;
+		events += dispatch_prio_class(udpcan, prio, busy_start_ns,
+				&handler_start_ns, &slowest, &slowest_ns);
+	}
+	/* Packets queued with AF_XDP in this iteration go out now. */
+	for (int i = 0; i < udpcan->n_xsks; i++)
+		xdp_flush(udpcan->xsks[i]);
+	loop_iteration_done(loop, handler_start_ns - busy_start_ns, events,
+			slowest, slowest_ns);
+	HEAP_CHECK();
+	return events;
+}
+
+void udpcan_print_stats(struct udpcan *udpcan)
+{
+	for (int i = 0; i < udpcan->n_connections; i++)
+		print_stats(&udpcan->connections[i]);
+	for (int i = 0; i < udpcan->n_xsks; i++)
+		print_xdp_stats(udpcan->xsks[i]);
+	print_loop_stats(&udpcan->loop, &udpcan->resources.arena);
+#ifdef UDPCAN_PROFILE
+	print_profile();
+#endif
+}
+
+void udpcan_destroy(struct udpcan *udpcan)
+{
+	if (!udpcan)
+		return;
+	HEAP_UNLOCK();
+	for (int i = 0; i < udpcan->n_connections; i++)
+		free_connection(&udpcan->connections[i]);
+	for (int i = 0; i < udpcan->n_xsks; i++) {
+		struct xdp_iface *iface = udpcan->xsks[i]->iface;
+		int j = 0;
+		while (j < i && udpcan->xsks[j]->iface != iface)
+			j++;
+		if (j == i) {
+			free(iface->bindings);
+			free(iface);
+		}
+	}
+	free(udpcan->xsks);
+	/* Also unmaps the struct udpcan. */
+	release_resources(&udpcan->resources);
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Training and benchmark workload for profile-guided optimization. Runs
+# udpcan so that CAN frames generated on vcan0 travel over UDP to vcan1 and
+# prints the event loop statistics, whose busy time is the figure to compare
+# between builds.
+#
+# Requires vcan0 and vcan1 to be up (see README.md) and cangen from can-utils.
+#
+# Usage: pgo-train.sh UDPCAN_BINARY
+
+set -e
+
+udpcan=${1:?Usage: $0 UDPCAN_BINARY}
+frames=${FRAMES:-200000}
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+
+"$udpcan" -b 0 vcan0:8880:127.0.0.1:8881 vcan1:8881:127.0.0.1:8880 \
+	> "$out" &
+pid=$!
+sleep 0.5
+cangen vcan0 -g 0 -n "$frames" -L 8 -I i
+sleep 0.5
+kill -INT "$pid"
+wait "$pid"
+echo "$udpcan:"
+grep 'udpcan: event loop' "$out"
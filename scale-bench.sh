@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Scaling benchmark. For each bridge count, runs udpcan with two bridges that
+# forward CAN frames generated by cangen on vcan0 over UDP to vcan1, plus idle
+# bridges on vcan2, and prints the startup time, the resident memory and the
+# arena memory per bridge, and the throughput of the busy bridges in frames
+# per second of event loop busy time.
+#
+# With AUTH=1, the busy bridges authenticate their traffic (the auth option)
+# and the frames per datagram and the MAC cost per datagram and per frame on
+# the sending side are printed too, to see how batching amortizes the MAC.
+#
+# Requires vcan0, vcan1 and vcan2 to be up (see README.md), cangen from
+# can-utils, and a hard limit of open files above twice the largest count.
+#
+# Usage: [AUTH=1] scale-bench.sh UDPCAN_BINARY [COUNT]...
+
+set -e
+
+udpcan=${1:?Usage: $0 UDPCAN_BINARY [COUNT]...}
+shift
+[ $# -gt 0 ] || set -- 2 100 1000 10000
+frames=${FRAMES:-200000}
+out=$(mktemp)
+key=$(mktemp)
+trap 'rm -f "$out" "$key"' EXIT
+opts=quiet
+if [ "${AUTH:-0}" != 0 ]; then
+	od -An -tx1 -N16 /dev/urandom > "$key"
+	opts="quiet,auth=$key"
+fi
+
+printf '%8s %11s %10s %15s %12s' bridges startup_ms rss_kib \
+	arena_b/bridge frames/s
+if [ "${AUTH:-0}" != 0 ]; then
+	printf ' %12s %12s %12s' frames/dgram mac_ns/dgram mac_ns/frame
+fi
+printf '\n'
+for count in "$@"; do
+	# Idle bridges listen on ports from 20000 up and send to themselves.
+	specs=$(seq 20000 $((20000 + count - 3)) |
+		sed 's/.*/vcan2:&:127.0.0.1:&,quiet/')
+	# Word splitting of specs is intended.
+	# shellcheck disable=SC2086
+	"$udpcan" -b 0 "vcan0:8880:127.0.0.1:8881,$opts" \
+		"vcan1:8881:127.0.0.1:8880,$opts" $specs > "$out" &
+	pid=$!
+	until grep -q 'bridges set up' "$out"; do
+		kill -0 "$pid"
+		sleep 0.1
+	done
+	startup_ms=$(sed -n 's/.* set up in \([0-9.]*\) ms$/\1/p' "$out")
+	rss_kib=$(awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status")
+	cangen vcan0 -g 0 -n "$frames" -L 8 -I i
+	sleep 0.5
+	kill -INT "$pid"
+	wait "$pid"
+	awk -v count="$count" -v frames="$frames" -v startup_ms="$startup_ms" \
+			-v rss_kib="$rss_kib" -v auth="${AUTH:-0}" '
+		/: event loop busy: count / {
+			busy_us = $6 * $8
+		}
+		/: memory: arena / {
+			arena_kib = $4
+		}
+		# Datagrams, frames and MAC costs of the bridge reading vcan0.
+		/^vcan0:8880:.*: auth sent: / {
+			datagrams = $5 + 0
+			tx_frames = $7 + 0
+			mac_datagram_ns = $9
+			mac_frame_ns = $11
+		}
+		END {
+			printf "%8d %11s %10d %15.0f %12.0f", count,
+				startup_ms, rss_kib, arena_kib * 1024 / count,
+				(busy_us > 0 ? frames / (busy_us / 1e6) : 0)
+			if (auth != 0) {
+				printf " %12.1f %12d %12d",
+					(datagrams > 0 ? tx_frames / datagrams : 0),
+					mac_datagram_ns, mac_frame_ns
+			}
+			printf "\n"
+		}' "$out"
+done
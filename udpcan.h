@@ -0,0 +1,143 @@
+/*
+ * libudpcan: CAN <-> UDP bridging inside an application.
+ *
+ * A struct udpcan is a set of bridges sharing an event loop. Each bridge is
+ * described by the same spec as a udpcan command line argument,
+ * CAN_IFNAME:IN_PORT:OUT_HOST:OUT_PORT[,OPTION[=VALUE]]... (see README.md).
+ * The application either lets udpcan_poll() block, or adds the fd returned
+ * by udpcan_fd() to its own event loop and calls udpcan_poll() with a zero
+ * timeout when it is readable.
+ *
+ * Setup calls print an error to stderr and return one when a spec is invalid
+ * or its sockets can't be set up. Failures once forwarding has started, and
+ * running out of memory, are fatal: the error is printed and the process
+ * exits.
+ *
+ * The library is not thread-safe, all calls must come from the same thread.
+ * Several instances may coexist, each with its own memory and fds. They
+ * share process-global state:
+ * - the profiler of the udpcan-prof build, calibrated by udpcan_start() and
+ *   printed by udpcan_print_stats(), which accounts for all instances;
+ * - the heap check of the udpcan-debug build, which asserts that no memory
+ *   is allocated from the heap once an instance has started, until one is
+ *   destroyed, so that other instances must be set up first;
+ * - stdout and stderr, where messages and statistics are printed.
+ */
+#ifndef UDPCAN_H
+#define UDPCAN_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <linux/can.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct udpcan;
+struct udpcan_bridge;
+
+/* Flags of udpcan_create(). */
+enum {
+	/* Allocate memory on huge pages, falling back to normal pages. */
+	UDPCAN_HUGE_PAGES = 1 << 0,
+};
+
+/* Direction of a forwarded CAN frame. */
+enum udpcan_dir {
+	UDPCAN_CAN_TO_UDP,
+	UDPCAN_UDP_TO_CAN,
+};
+
+/* Called for each CAN frame forwarded by a bridge. */
+typedef void (*udpcan_frame_cb)(struct udpcan_bridge *bridge,
+		enum udpcan_dir dir, const struct can_frame *frame, void *arg);
+
+/*
+ * Called with the CAN frames a bridge forwarded at once: those read from CAN
+ * in one go, or those carried by one datagram.
+ */
+typedef void (*udpcan_batch_cb)(struct udpcan_bridge *bridge,
+		enum udpcan_dir dir, const struct can_frame *frames,
+		int n_frames, void *arg);
+
+/*
+ * Creates an empty set of up to max_bridges bridges. Returns NULL if its
+ * memory can't be mapped.
+ */
+struct udpcan *udpcan_create(int max_bridges, unsigned flags);
+
+/*
+ * Sets the max time an event loop iteration may spend handling events
+ * before a warning is printed, 0 to disable the warning. Default 10 ms.
+ */
+void udpcan_set_budget(struct udpcan *udpcan, uint64_t budget_us);
+
+/*
+ * Adds a bridge. Must be called before udpcan_start(). Returns NULL if the
+ * spec is invalid or the sockets of the bridge can't be set up, in which case
+ * the other bridges are unaffected.
+ */
+struct udpcan_bridge *udpcan_add_bridge(struct udpcan *udpcan,
+		const char *spec);
+
+/*
+ * Registers a callback for each forwarded CAN frame, NULL to remove it.
+ * Callbacks are not supported in J1939 mode. The frame must not be kept
+ * after the callback returns.
+ */
+void udpcan_set_frame_cb(struct udpcan_bridge *bridge, udpcan_frame_cb cb,
+		void *arg);
+
+/* Registers a callback for each batch of forwarded CAN frames. */
+void udpcan_set_batch_cb(struct udpcan_bridge *bridge, udpcan_batch_cb cb,
+		void *arg);
+
+/*
+ * Sends a CAN frame to the UDP destinations of a bridge, as if it had been
+ * read from its CAN interface. Returns -1 with errno set on failure.
+ * Not supported in J1939 mode.
+ */
+int udpcan_send(struct udpcan_bridge *bridge, const struct can_frame *frame);
+
+/* Returns the spec of a bridge, for messages. */
+const char *udpcan_bridge_name(const struct udpcan_bridge *bridge);
+
+/*
+ * Completes the setup of all bridges (resolution of OUT_HOST, AF_XDP, timers,
+ * impairment) and starts forwarding. From here on, forwarding allocates no
+ * memory. Returns -1 if OUT_HOST can't be resolved or other resources can't
+ * be set up, after which udpcan may only be destroyed.
+ */
+int udpcan_start(struct udpcan *udpcan);
+
+/*
+ * Returns the epoll fd the event loop waits on. It is readable when there are
+ * events to handle.
+ */
+int udpcan_fd(struct udpcan *udpcan);
+
+/*
+ * Waits up to timeout_ms milliseconds (-1 for no limit) for events and
+ * handles them. sigmask, if not NULL, is the signal mask to wait with, as in
+ * epoll_pwait(). Returns the number of events handled, or -1 with errno set,
+ * e.g. EINTR if interrupted by a signal.
+ */
+int udpcan_poll(struct udpcan *udpcan, int timeout_ms,
+		const sigset_t *sigmask);
+
+/* Prints statistics of all bridges and the event loop to stdout. */
+void udpcan_print_stats(struct udpcan *udpcan);
+
+/*
+ * Stops forwarding and releases all resources of udpcan: sockets, epoll fds,
+ * the timerfd, AF_XDP sockets and XDP programs, and memory. Bridges are
+ * invalid afterwards. Does nothing if udpcan is NULL.
+ */
+void udpcan_destroy(struct udpcan *udpcan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UDPCAN_H */